@@ -0,0 +1,315 @@
+
+// Single-thread microbenchmarks for the xmalloc backends.
+//
+// Link against one backend (bench-sys, bench-hw7, bench-par) and run.
+// Every test takes many samples, each timing a short batch of
+// operations with the cycle counter, and prints the distribution of
+// cycles per operation rather than one total. With -t N, N threads run
+// the whole suite at once and the first one's numbers are printed.
+//
+//  pair      xmalloc(n) + xfree, for each size class
+//  pair-c    the same with a compile-time constant size
+//  lifo/fifo xmalloc N chunks, then free them newest- or oldest-first
+//  realloc   grow one buffer by doubling, or by a fixed step
+//  chase     walk a linked list built from xmalloc'd cells, or from
+//            xpool slots linked by 32-bit handles (chase-h)
+//  free      just the xfree of N chunks, or xfree_deferred with the
+//            reclaimer running (free-d)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "xmalloc.h"
+#include "xlat.h"
+#include "xpool.h"
+
+#define BATCH 32 // operations per timed sample in the pair tests
+#define NBATCH 256 // chunks per sample in the lifo/fifo tests
+#define NCHASE (1 << 20) // list length in the chase tests
+#define NFREE 16 // chunks freed per sample in the free tests
+
+static int samples = 1000;
+static __thread uint64_t* cycles;
+static __thread int quiet = 0; // every thread but the first
+
+static
+int
+cmp_u64(const void* aa, const void* bb)
+{
+    uint64_t xx = *(const uint64_t*)aa;
+    uint64_t yy = *(const uint64_t*)bb;
+    return (xx > yy) - (xx < yy);
+}
+
+// cycles[] holds total cycles per sample; each sample did ops operations
+static
+void
+report(const char* test, size_t size, int nn, long ops)
+{
+    if (quiet) {
+        return;
+    }
+    qsort(cycles, nn, sizeof(uint64_t), cmp_u64);
+
+    double per = (double)ops;
+    printf("%-10s %8zu %8.1f %8.1f %8.1f %8.1f %8.1f\n", test, size,
+           cycles[0] / per,
+           cycles[nn / 2] / per,
+           cycles[nn * 9 / 10] / per,
+           cycles[nn * 99 / 100] / per,
+           cycles[nn - 1] / per);
+}
+
+static
+void
+bench_pair(size_t size)
+{
+    for (int ss = 0; ss < samples; ++ss) {
+        uint64_t t0 = xlat_now();
+        for (int ii = 0; ii < BATCH; ++ii) {
+            char* ptr = xmalloc(size);
+            ptr[0] = 1;
+            xfree(ptr);
+        }
+        cycles[ss] = xlat_now() - t0;
+    }
+    report("pair", size, samples, BATCH);
+}
+
+static
+void
+bench_pair_const()
+{
+    // sizeof-style constant, so the inline path in xmalloc.h can hit
+    for (int ss = 0; ss < samples; ++ss) {
+        uint64_t t0 = xlat_now();
+        for (int ii = 0; ii < BATCH; ++ii) {
+            char* ptr = xmalloc(16);
+            ptr[0] = 1;
+            xfree(ptr);
+        }
+        cycles[ss] = xlat_now() - t0;
+    }
+    report("pair-c", 16, samples, BATCH);
+}
+
+static
+void
+bench_batch(size_t size, int fifo)
+{
+    static __thread void* ptrs[NBATCH];
+    int nn = samples / 10 + 1;
+
+    for (int ss = 0; ss < nn; ++ss) {
+        uint64_t t0 = xlat_now();
+        for (int ii = 0; ii < NBATCH; ++ii) {
+            ptrs[ii] = xmalloc(size);
+            *(char*)ptrs[ii] = 1;
+        }
+        if (fifo) {
+            for (int ii = 0; ii < NBATCH; ++ii) {
+                xfree(ptrs[ii]);
+            }
+        }
+        else {
+            for (int ii = NBATCH - 1; ii >= 0; --ii) {
+                xfree(ptrs[ii]);
+            }
+        }
+        cycles[ss] = xlat_now() - t0;
+    }
+    report(fifo ? "fifo" : "lifo", size, nn, 2 * NBATCH);
+}
+
+static
+void
+bench_realloc(const char* test, size_t step, size_t top)
+{
+    int nn = samples / 10 + 1;
+    long ops = 0;
+
+    for (int ss = 0; ss < nn; ++ss) {
+        ops = 0;
+        uint64_t t0 = xlat_now();
+        size_t size = 16;
+        char* ptr = xmalloc(size);
+        while (size < top) {
+            size = step ? size + step : size * 2;
+            ptr = xrealloc(ptr, size);
+            ptr[size - 1] = 1;
+            ops++;
+        }
+        xfree(ptr);
+        cycles[ss] = xlat_now() - t0;
+    }
+    report(test, top, nn, ops);
+}
+
+typedef struct pcell {
+    long          item;
+    struct pcell* rest;
+} pcell;
+
+typedef struct hcell {
+    long    item;
+    xhandle rest;
+} hcell;
+
+static
+void
+bench_chase()
+{
+    int nn = samples / 100 + 1;
+    long sum = 0;
+
+    // built back to front, like list.h's cons, so nodes are walked in
+    // reverse allocation order
+    pcell* plist = 0;
+    for (long ii = 0; ii < NCHASE; ++ii) {
+        pcell* xs = xmalloc(sizeof(pcell));
+        xs->item = ii;
+        xs->rest = plist;
+        plist = xs;
+    }
+    for (int ss = 0; ss < nn; ++ss) {
+        uint64_t t0 = xlat_now();
+        for (pcell* xs = plist; xs; xs = xs->rest) {
+            sum += xs->item;
+        }
+        cycles[ss] = xlat_now() - t0;
+    }
+    report("chase", sizeof(pcell), nn, NCHASE);
+    while (plist) {
+        pcell* ys = plist->rest;
+        xfree(plist);
+        plist = ys;
+    }
+
+    xpool* pool = xpool_create(sizeof(hcell), NCHASE);
+    xhandle hlist = 0;
+    for (long ii = 0; ii < NCHASE; ++ii) {
+        xhandle hh = xpool_alloc(pool);
+        hcell* xs = xpool_ptr(pool, hh);
+        xs->item = ii;
+        xs->rest = hlist;
+        hlist = hh;
+    }
+    for (int ss = 0; ss < nn; ++ss) {
+        uint64_t t0 = xlat_now();
+        for (xhandle hh = hlist; hh; ) {
+            hcell* xs = xpool_ptr(pool, hh);
+            sum += xs->item;
+            hh = xs->rest;
+        }
+        cycles[ss] = xlat_now() - t0;
+    }
+    report("chase-h", sizeof(hcell), nn, NCHASE);
+    xpool_destroy(pool);
+
+    // keep the walks from being optimized out
+    if (sum == 42) {
+        printf("\n");
+    }
+}
+
+static
+void
+bench_free(size_t size, int deferred)
+{
+    static __thread void* ptrs[NFREE];
+    int nn = samples / 10 + 1;
+
+    for (int ss = 0; ss < nn; ++ss) {
+        for (int ii = 0; ii < NFREE; ++ii) {
+            ptrs[ii] = xmalloc(size);
+            *(char*)ptrs[ii] = 1;
+        }
+        uint64_t t0 = xlat_now();
+        for (int ii = 0; ii < NFREE; ++ii) {
+            if (deferred) {
+                xfree_deferred(ptrs[ii]);
+            }
+            else {
+                xfree(ptrs[ii]);
+            }
+        }
+        cycles[ss] = xlat_now() - t0;
+    }
+    xfree_drain();
+    report(deferred ? "free-d" : "free", size, nn, NFREE);
+}
+
+static
+void*
+run_suite(void* arg)
+{
+    quiet = arg != 0;
+    cycles = calloc(samples, sizeof(uint64_t));
+
+    for (int bucket = 0; bucket < XM_BUCKETS; ++bucket) {
+        bench_pair(xm_bucket_size(bucket) - sizeof(size_t));
+    }
+    bench_pair(4 * XM_MAX_SMALL);
+    bench_pair_const();
+
+    size_t batch_sizes[] = { 16, 256, 4096 };
+    for (int ii = 0; ii < 3; ++ii) {
+        bench_batch(batch_sizes[ii], 0);
+        bench_batch(batch_sizes[ii], 1);
+    }
+
+    bench_realloc("realloc2x", 0, 1 << 20);
+    bench_realloc("realloc+16", 16, 4096);
+
+    bench_chase();
+
+    xfree_start_reclaimer(0);
+    bench_free(4096, 0);
+    bench_free(4096, 1);
+    bench_free(4 * XM_MAX_SMALL, 0);
+    bench_free(4 * XM_MAX_SMALL, 1);
+
+    free(cycles);
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    int nthreads = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        if (opt != 't' || (nthreads = atoi(optarg)) < 1) {
+            argc = 0;
+            break;
+        }
+    }
+    if (argc == 0 || argc - optind > 1) {
+        printf("Usage:\n");
+        printf("\t%s [-t THREADS] [SAMPLES]\n", argv[0]);
+        return 1;
+    }
+    if (optind < argc) {
+        samples = atoi(argv[optind]);
+        if (samples < 10) {
+            samples = 10;
+        }
+    }
+
+    printf("%-10s %8s %8s %8s %8s %8s %8s   (cycles per op)\n",
+           "test", "size", "min", "p50", "p90", "p99", "max");
+
+    pthread_t* threads = malloc(nthreads * sizeof(pthread_t));
+    for (long ii = 1; ii < nthreads; ++ii) {
+        pthread_create(&(threads[ii]), 0, run_suite, (void*)ii);
+    }
+    run_suite(0);
+    for (long ii = 1; ii < nthreads; ++ii) {
+        pthread_join(threads[ii], 0);
+    }
+    free(threads);
+    return 0;
+}
@@ -0,0 +1,40 @@
+
+// Checks xfree_deferred against par's guard sampling: run with
+// XMALLOC_GUARD=1 so every small allocation gets a guard slot, and
+// defer chunks of every size from 0 up, including the ones too small
+// to hold the queue's link. Any damage to a guarded chunk aborts.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "xmalloc.h"
+
+#define ROUNDS 2000
+#define MAX_SIZE 24
+
+int
+main(int argc, char* argv[])
+{
+    for (int ii = 0; ii < ROUNDS; ++ii) {
+        size_t size = ii % (MAX_SIZE + 1);
+        char* ptr = xmalloc(size);
+        memset(ptr, 0x5a, size);
+        xfree_deferred(ptr);
+        if (ii % 100 == 99) {
+            xfree_drain();
+        }
+    }
+    xfree_drain();
+
+    xfree_start_reclaimer(1);
+    for (int ii = 0; ii < ROUNDS; ++ii) {
+        size_t size = ii % (MAX_SIZE + 1);
+        char* ptr = xmalloc(size);
+        memset(ptr, 0xa5, size);
+        xfree_deferred(ptr);
+    }
+    xfree_drain();
+
+    printf("deferred frees ok\n");
+    return 0;
+}
@@ -1,11 +1,15 @@
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <stdio.h>
 #include <pthread.h>
 #include <string.h>
+#include <stdint.h>
 
 #include "hmem.h"
+#include "xlat.h"
+#include "xcopy.h"
 
 
 
@@ -14,9 +18,11 @@ typedef struct list_node {
    struct list_node* next;
 } list_node;
 
-const size_t PAGE_SIZE = 4096;
+static const size_t PAGE_SIZE = 4096;
 static hm_stats stats; // This initializes the stats to 0.
 static list_node* free_list = 0;
+static long large_count = 0;  // atomic: hmalloc_large runs unlocked
+static size_t large_bytes = 0;
 
 // mutex
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
@@ -135,6 +141,8 @@ static
 void
 add_page()
 {
+    XLAT_SLOW();
+
     // maps a new page
     void* mem_addr = mmap(NULL, PAGE_SIZE, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
 
@@ -151,7 +159,7 @@ add_page()
     // let the insert function set its pointer
     free_list_insert(new_chunk);
 
-    stats.pages_mapped += 1;
+    __atomic_add_fetch(&stats.pages_mapped, 1, __ATOMIC_RELAXED);
 }
 
 static
@@ -221,6 +229,7 @@ get_free_chunk(size_t size)
 hm_stats*
 hgetstats() {
     stats.free_length = free_list_length();
+    xlock_collect(&stats);
     return &stats;
 }
 
@@ -234,6 +243,8 @@ hprintstats()
     fprintf(stderr, "Allocs:   %ld\n", stats.chunks_allocated);
     fprintf(stderr, "Frees:    %ld\n", stats.chunks_freed);
     fprintf(stderr, "Freelen:  %ld\n", stats.free_length);
+    xlat_print(stderr);
+    xlock_print(stderr);
 }
 
 static
@@ -259,14 +270,18 @@ hmalloc_large(size_t size)
 {
     // here, the size is the true size we need.
 
-    int num_pages = div_up(size, PAGE_SIZE);
+    size_t num_pages = div_up(size, PAGE_SIZE);
+
+    XLAT_SLOW();
 
-    // mmap enough pages for the big thing
-    void* new_addr = mmap(NULL, num_pages * PAGE_SIZE, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    // mmap enough pages for the big thing. private, so hrealloc can
+    // mremap it; a shared mapping can't grow past its first size.
+    void* new_addr = mmap(NULL, num_pages * PAGE_SIZE, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
 
     if((long)new_addr == -1)
     {
         perror("mapping new LARGE page");
+        return 0;
     }
 
     list_node* new_chunk = (list_node*)new_addr;
@@ -274,7 +289,9 @@ hmalloc_large(size_t size)
     new_chunk->size = num_pages * PAGE_SIZE;
     new_chunk->next = 0;
 
-    stats.pages_mapped += num_pages;
+    __atomic_add_fetch(&stats.pages_mapped, num_pages, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&large_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&large_bytes, new_chunk->size, __ATOMIC_RELAXED);
 
     return new_addr + sizeof(size_t);
 }
@@ -283,7 +300,7 @@ hmalloc_large(size_t size)
 void*
 hmalloc(size_t size)
 {
-    pthread_mutex_lock(&lock);
+    XLOCK(&lock, HM_LOCK_MALLOC);
     stats.chunks_allocated += 1;
 
     size_t og_size = size;
@@ -300,20 +317,72 @@ hmalloc(size_t size)
     if (size > PAGE_SIZE)
     {
         //mmap the entire page.
-        pthread_mutex_unlock(&lock);
+        XUNLOCK(&lock);
         return hmalloc_large(size);
     }
 
     void* mem_addr = get_free_chunk(size);
 
-    pthread_mutex_unlock(&lock);
+    XUNLOCK(&lock);
     return mem_addr + sizeof(size_t);
 }
 
+int
+hmalloc_batch(size_t size, void** items, int count)
+{
+    // fills items with count chunks of the given size, taking the lock
+    // once. only for sizes that fit in a page.
+    size += sizeof(size_t);
+    if (size < (sizeof(list_node*) + sizeof(size_t)))
+    {
+        size = (sizeof(list_node*) + sizeof(size_t));
+    }
+    if (size > PAGE_SIZE)
+    {
+        return 0;
+    }
+
+    XLOCK(&lock, HM_LOCK_MALLOC);
+    stats.chunks_allocated += count;
+    for (int ii = 0; ii < count; ++ii)
+    {
+        items[ii] = (void*)get_free_chunk(size) + sizeof(size_t);
+    }
+    XUNLOCK(&lock);
+
+    return count;
+}
+
+void*
+hcalloc(size_t nn, size_t size)
+{
+    size_t bytes;
+    if (__builtin_mul_overflow(nn, size, &bytes) ||
+        bytes > SIZE_MAX - sizeof(size_t))
+    {
+        return 0;
+    }
+
+    if (bytes + sizeof(size_t) > PAGE_SIZE)
+    {
+        // large chunks always get their own fresh mapping, which the
+        // kernel already zeroed; don't fault every page in again
+        XLOCK(&lock, HM_LOCK_MALLOC);
+        stats.chunks_allocated += 1;
+        XUNLOCK(&lock);
+        return hmalloc_large(bytes + sizeof(size_t));
+    }
+
+    // small chunks are carved out of recycled pages
+    void* mem_addr = hmalloc(bytes);
+    memset(mem_addr, 0, bytes);
+    return mem_addr;
+}
+
 void
 hfree(void* item)
 {
-    pthread_mutex_lock(&lock);
+    XLOCK(&lock, HM_LOCK_FREE);
 
     stats.chunks_freed += 1;
 
@@ -325,6 +394,7 @@ hfree(void* item)
     //if larger than a page
     if (chunk->size > PAGE_SIZE)
     {
+        XLAT_SLOW();
         int pages = div_up(chunk->size, PAGE_SIZE);
         //unmap the page divided up
         int rv = munmap(chunk, chunk->size);
@@ -333,7 +403,9 @@ hfree(void* item)
             perror("unmapping large page");
         }
 
-        stats.pages_unmapped += pages;
+        __atomic_add_fetch(&stats.pages_unmapped, pages, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&large_count, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&large_bytes, pages * PAGE_SIZE, __ATOMIC_RELAXED);
     }
     else
     {
@@ -343,49 +415,313 @@ hfree(void* item)
     // coalesce it all
     coalesce();
 
-    pthread_mutex_unlock(&lock);
+    XUNLOCK(&lock);
+}
+
+void
+hfree_batch(void** items, int count)
+{
+    // returns count small chunks, taking the lock and coalescing once
+    XLOCK(&lock, HM_LOCK_FREE);
+    stats.chunks_freed += count;
+    for (int ii = 0; ii < count; ++ii)
+    {
+        list_node* chunk = (list_node*)(items[ii] - sizeof(size_t));
+        chunk->next = 0;
+        free_list_insert(chunk);
+    }
+    coalesce();
+    XUNLOCK(&lock);
+}
+
+void
+hwalk(void (*fn)(void* chunk, size_t size, void* arg), void* arg)
+{
+    XLOCK(&lock, HM_LOCK_OTHER);
+    for (list_node* curr = free_list; curr; curr = curr->next)
+    {
+        fn(curr, curr->size, arg);
+    }
+    XUNLOCK(&lock);
+}
+
+void
+hlarge_stats(long* count, size_t* bytes)
+{
+    *count = __atomic_load_n(&large_count, __ATOMIC_RELAXED);
+    *bytes = __atomic_load_n(&large_bytes, __ATOMIC_RELAXED);
+}
+
+size_t
+hpurge()
+{
+    // every page that a free chunk covers completely goes back to the
+    // kernel. pages were mapped one at a time but munmap doesn't mind
+    // a range spanning several mappings. what's left of the chunk on
+    // either side stays on the list, if it's big enough to.
+    size_t min_chunk = sizeof(list_node*) + sizeof(size_t);
+    long pages = 0;
+
+    XLOCK(&lock, HM_LOCK_OTHER);
+    list_node** link = &free_list;
+    while (*link)
+    {
+        list_node* curr = *link;
+        uintptr_t start = (uintptr_t)curr;
+        uintptr_t end = start + curr->size;
+        uintptr_t pstart = (start + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        uintptr_t pend = end & ~(PAGE_SIZE - 1);
+        size_t head = pstart - start;
+        size_t tail = end - pend;
+
+        if (pend <= pstart ||
+            (head && head < min_chunk) || (tail && tail < min_chunk))
+        {
+            link = &(curr->next);
+            continue;
+        }
+
+        list_node* next = curr->next;
+        if (tail)
+        {
+            list_node* rest = (list_node*)pend;
+            rest->size = tail;
+            rest->next = next;
+            next = rest;
+        }
+        if (head)
+        {
+            curr->size = head;
+            curr->next = next;
+            link = &(curr->next);
+        }
+        else
+        {
+            *link = next;
+        }
+
+        if (munmap((void*)pstart, pend - pstart) == -1)
+        {
+            perror("unmapping free pages");
+        }
+        pages += (pend - pstart) / PAGE_SIZE;
+    }
+    __atomic_add_fetch(&stats.pages_unmapped, pages, __ATOMIC_RELAXED);
+    XUNLOCK(&lock);
+
+    return pages * PAGE_SIZE;
+}
+
+size_t
+hmapped_bytes()
+{
+    long mapped = __atomic_load_n(&stats.pages_mapped, __ATOMIC_RELAXED);
+    long unmapped = __atomic_load_n(&stats.pages_unmapped, __ATOMIC_RELAXED);
+    return (mapped - unmapped) * PAGE_SIZE;
+}
+
+size_t
+husable_size(void* item)
+{
+    // the chunk may be a little bigger than asked for when the leftover
+    // was too small to go back on the free list
+    list_node* chunk = (list_node*)(item - sizeof(size_t));
+    return chunk->size - sizeof(size_t);
+}
+
+static
+void
+release_chunk(list_node* chunk)
+{
+    // free_list_insert, merging with the neighbors right away. the
+    // list is always fully coalesced, so that's all coalesce() would
+    // have found. lock held.
+    list_node* before = 0;
+    list_node** link = &free_list;
+    while (*link && *link < chunk)
+    {
+        before = *link;
+        link = &((*link)->next);
+    }
+
+    list_node* after = *link;
+    if (after && (void*)chunk + chunk->size == (void*)after)
+    {
+        chunk->size += after->size;
+        after = after->next;
+    }
+    if (before && (void*)before + before->size == (void*)chunk)
+    {
+        before->size += chunk->size;
+        before->next = after;
+    }
+    else
+    {
+        chunk->next = after;
+        *link = chunk;
+    }
+}
+
+static
+int
+grow_in_place(list_node* chunk, size_t size)
+{
+    // takes what chunk is short of from the free chunk right after it,
+    // if there is one and it's big enough. the list is sorted, so the
+    // neighbor is where chunk's end would be inserted. lock held.
+    size_t min_chunk = sizeof(list_node*) + sizeof(size_t);
+    void* end = (void*)chunk + chunk->size;
+
+    list_node** link = &free_list;
+    while (*link && (void*)*link < end)
+    {
+        link = &((*link)->next);
+    }
+
+    list_node* next = *link;
+    if ((void*)next != end || chunk->size + next->size < size)
+    {
+        return 0;
+    }
+
+    size_t rest = chunk->size + next->size - size;
+    list_node* after = next->next;
+    if (rest >= min_chunk)
+    {
+        // what's left takes the neighbor's place on the list. it may
+        // overlap the neighbor's header, so that's read first.
+        list_node* excess = (list_node*)((void*)chunk + size);
+        excess->size = rest;
+        excess->next = after;
+        *link = excess;
+        chunk->size = size;
+    }
+    else
+    {
+        // too little left to list; take the whole neighbor, unless
+        // that would make chunk look like a large mapping to hfree
+        if (chunk->size + next->size > PAGE_SIZE)
+        {
+            return 0;
+        }
+        *link = after;
+        chunk->size += next->size;
+    }
+    return 1;
+}
+
+static
+list_node*
+resize_large(list_node* chunk, size_t size)
+{
+    // resizes a large chunk's mapping. the kernel grows it in place if
+    // the pages after it are free, and moves the pages otherwise, which
+    // still doesn't copy them.
+    size_t old_size = chunk->size;
+    size_t new_size = div_up(size, PAGE_SIZE) * PAGE_SIZE;
+    if (new_size == old_size)
+    {
+        return chunk;
+    }
+
+    XLAT_SLOW();
+    void* addr = mremap(chunk, old_size, new_size, MREMAP_MAYMOVE);
+    if (addr == MAP_FAILED)
+    {
+        return 0;
+    }
+
+    long pages = (long)(new_size / PAGE_SIZE) - (long)(old_size / PAGE_SIZE);
+    if (pages > 0)
+    {
+        __atomic_add_fetch(&stats.pages_mapped, pages, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_add_fetch(&stats.pages_unmapped, -pages, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&large_bytes, pages * PAGE_SIZE, __ATOMIC_RELAXED);
+
+    list_node* moved = (list_node*)addr;
+    moved->size = new_size;
+    return moved;
 }
 
 void*
 hrealloc(void* prev, size_t bytes)
 {
-    list_node* prev_node = (list_node*)(prev - sizeof(size_t));
-    size_t prev_size = prev_node->size;
-    size_t true_bytes = bytes + sizeof(size_t);
-
     if (!prev)
     {
         return hmalloc(bytes);
     }
-    else if (bytes == 0)
+    if (bytes == 0)
     {
         hfree(prev);
         return 0;
     }
-    else if (true_bytes == prev_size)
+
+    list_node* prev_node = (list_node*)(prev - sizeof(size_t));
+    size_t prev_size = prev_node->size;
+    size_t true_bytes = bytes + sizeof(size_t);
+    size_t min_chunk = sizeof(list_node*) + sizeof(size_t);
+    if (true_bytes < min_chunk)
+    {
+        true_bytes = min_chunk;
+    }
+
+    if (prev_size > PAGE_SIZE)
     {
-        // do nothing
-        return prev;
+        // large stays large without a copy if it can. shrinking below
+        // a page moves to a small chunk, which hfree won't munmap.
+        if (true_bytes > PAGE_SIZE)
+        {
+            list_node* chunk = resize_large(prev_node, true_bytes);
+            if (chunk)
+            {
+                return (void*)chunk + sizeof(size_t);
+            }
+        }
     }
-    else if (true_bytes < prev_size)
+    else if (true_bytes <= prev_size)
     {
-        // return the difference to the freelist
+        // give the tail back, if it's big enough to be a free chunk
+        XLOCK(&lock, HM_LOCK_REALLOC);
         size_t excess_amt = prev_size - true_bytes;
-        void* excess_addr = (void*)prev + true_bytes;
-        list_node* excess = (list_node*)excess_addr;
-        excess->size = excess_amt;
-        excess->next = 0;
-        free_list_insert(excess);
-
-        // return old pointer
+        if (excess_amt >= min_chunk)
+        {
+            prev_node->size = true_bytes;
+            list_node* excess = (list_node*)((void*)prev_node + true_bytes);
+            excess->size = excess_amt;
+            release_chunk(excess);
+        }
+        XUNLOCK(&lock);
         return prev;
     }
-    else
+    else if (true_bytes <= PAGE_SIZE)
     {
-        // we need more space than we have
-        void* new_mem = hmalloc(bytes);
-        memcpy(new_mem, prev, (prev_size - sizeof(size_t)));
-        hfree(prev);
+        XLOCK(&lock, HM_LOCK_REALLOC);
+        if (grow_in_place(prev_node, true_bytes))
+        {
+            XUNLOCK(&lock);
+            return prev;
+        }
+
+        // move, without letting go of the lock in between
+        XLAT_SLOW();
+        stats.chunks_allocated += 1;
+        stats.chunks_freed += 1;
+        void* new_mem = (void*)get_free_chunk(true_bytes) + sizeof(size_t);
+        xcopy(new_mem, prev, prev_size - sizeof(size_t));
+        release_chunk(prev_node);
+        XUNLOCK(&lock);
         return new_mem;
     }
+
+    // between small and large
+    XLAT_SLOW();
+    void* new_mem = hmalloc(bytes);
+    size_t keep = prev_size - sizeof(size_t);
+    xcopy(new_mem, prev, keep < bytes ? keep : bytes);
+    hfree(prev);
+    return new_mem;
 }
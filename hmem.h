@@ -4,19 +4,30 @@
 // Husky Malloc Interface
 // cs3650 Starter Code
 
-typedef struct hm_stats {
-    long pages_mapped;
-    long pages_unmapped;
-    long chunks_allocated;
-    long chunks_freed;
-    long free_length;
-} hm_stats;
-
-hm_stats* hgetstats();
-void hprintstats();
+#include "hstats.h"
 
 void* hmalloc(size_t size);
 void hfree(void* item);
+void* hcalloc(size_t nn, size_t size);
 void* hrealloc(void* prev, size_t bytes);
+size_t husable_size(void* item);
+
+// Batch interface for caches layered on top: one lock round trip for
+// count chunks. hmalloc_batch only takes sizes that fit in a page and
+// returns how many chunks it handed out.
+int hmalloc_batch(size_t size, void** items, int count);
+void hfree_batch(void** items, int count);
+
+// Introspection. hwalk calls fn on every chunk on the free list (size
+// includes the header) while holding the lock, so fn mustn't call back
+// into hmem. hlarge_stats counts the chunks that got their own mapping.
+void hwalk(void (*fn)(void* chunk, size_t size, void* arg), void* arg);
+void hlarge_stats(long* count, size_t* bytes);
+
+// Memory pressure. hpurge unmaps every page the free list covers
+// completely and returns how many bytes that was. hmapped_bytes is
+// what's mapped right now, large chunks included.
+size_t hpurge();
+size_t hmapped_bytes();
 
 #endif
@@ -0,0 +1,46 @@
+#ifndef HSTATS_H
+#define HSTATS_H
+
+// Allocator statistics, shared by hmem.h and xmalloc.h so a file can
+// include both.
+
+#include "xbackend.h"
+
+// Lock statistics, only collected in -DXM_LOCKSTAT builds. Times are
+// in the same ticks as the latency histograms (see xlat.h).
+#define HM_LOCK_MALLOC  0
+#define HM_LOCK_FREE    1
+#define HM_LOCK_REALLOC 2
+#define HM_LOCK_OTHER   3
+#define HM_LOCK_OPS     4
+#define HM_MAX_LOCKS    32
+
+typedef struct hm_lockstat {
+    long acquired;
+    long contended; // trylock failed, had to wait
+    long wait;      // total ticks spent waiting
+    long wait_max;
+    long hold;      // total ticks held
+    long hold_max;
+} hm_lockstat;
+
+typedef struct hm_lockinfo {
+    const char* name;
+    void* addr;
+    hm_lockstat ops[HM_LOCK_OPS];
+} hm_lockinfo;
+
+typedef struct hm_stats {
+    long pages_mapped;
+    long pages_unmapped;
+    long chunks_allocated;
+    long chunks_freed;
+    long free_length;
+    long nlocks;
+    hm_lockinfo locks[HM_MAX_LOCKS];
+} hm_stats;
+
+hm_stats* hgetstats();
+void hprintstats();
+
+#endif
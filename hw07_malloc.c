@@ -2,28 +2,541 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include "hmem.h"
+#include "xmalloc.h"
+#include "xlat.h"
+#include "xpressure.h"
+
+// never filled; makes the inline path in xmalloc.h miss every time.
+// in the dispatch build par's are the only ones.
+#ifndef XM_BACKEND
+__thread xm_node* xm_heads[XM_BUCKETS];
+__thread long xm_sample_countdown;
+#endif
 
 /* CH02 TODO:
  *  - This should call / use your alloctor from the previous HW,
  *    modified to be thread-safe and have a realloc function.
  */
 
+/*
+thread cache documentation:
+every hmalloc/hfree takes hmem's one global lock, so small chunks are
+cached per thread in "magazines": fixed-size stacks of chunks of one
+class. each thread holds a loaded and a previous magazine per class and
+only touches shared state when both are empty (on alloc) or full (on
+free). then whole magazines are traded with a per-class depot, and the
+depot trades chunks with hmem in batches, one lock round trip each.
+
+classes are powers of two from 16 to 2048 usable bytes. requests are
+rounded up to a class; freed chunks go to the biggest class they can
+hold, as long as that doesn't waste more than half of them.
+
+build with -DXM_NO_TCACHE to go straight to hmem.
+
+under memory pressure (see xmalloc_purge) everything cached goes back
+to hmem: the purging thread's magazines and the depots right away,
+other threads' magazines the next time they visit a depot.
+*/
+
+#define TC_CLASSES   8
+#define TC_MIN_SHIFT 4
+#define TC_MAX       ((size_t)1 << (TC_MIN_SHIFT + TC_CLASSES - 1))
+#define MAG_SIZE     32
+#define DEPOT_MAX    8 // magazines of each kind a depot holds on to
+
+// set when hmem may have mapped more, so xmalloc checks the soft limit
+// once it's safely holding its chunk
+static __thread int hmem_grew = 0;
+
+#ifndef XM_NO_TCACHE
+
+typedef struct magazine {
+    struct magazine* next;
+    long count;
+    void* items[MAG_SIZE];
+} magazine;
+
+typedef struct depot {
+    pthread_mutex_t lock;
+    magazine* full;  // not empty, anyway
+    magazine* empty;
+    int nfull;
+    int nempty;
+} depot;
+
+static depot depots[TC_CLASSES] = {
+    [0 ... TC_CLASSES - 1] = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0 }
+};
+
+static __thread magazine* loaded[TC_CLASSES];
+static __thread magazine* previous[TC_CLASSES];
+
+static pthread_key_t tc_key;
+static pthread_once_t tc_once = PTHREAD_ONCE_INIT;
+static __thread int tc_registered = 0;
+
+static long flush_gen = 0;
+static __thread long tc_gen = 0;
+
+static
+int
+tc_class_up(size_t bytes)
+{
+    if (bytes <= ((size_t)1 << TC_MIN_SHIFT)) {
+        return 0;
+    }
+    return 64 - __builtin_clzl(bytes - 1) - TC_MIN_SHIFT;
+}
+
+static
+int
+tc_class_down(size_t usable)
+{
+    return 63 - __builtin_clzl(usable) - TC_MIN_SHIFT;
+}
+
+static
+size_t
+tc_class_size(int cls)
+{
+    return (size_t)1 << (cls + TC_MIN_SHIFT);
+}
+
+static
+magazine*
+depot_get(magazine** list, int* count, int cls)
+{
+    depot* dd = &(depots[cls]);
+    XLOCK(&(dd->lock), HM_LOCK_OTHER);
+    magazine* mag = *list;
+    if (mag) {
+        *list = mag->next;
+        *count -= 1;
+    }
+    XUNLOCK(&(dd->lock));
+    return mag;
+}
+
+static
+void
+depot_put_empty(int cls, magazine* mag)
+{
+    depot* dd = &(depots[cls]);
+    XLOCK(&(dd->lock), HM_LOCK_OTHER);
+    if (dd->nempty < DEPOT_MAX) {
+        mag->next = dd->empty;
+        dd->empty = mag;
+        dd->nempty += 1;
+        mag = 0;
+    }
+    XUNLOCK(&(dd->lock));
+
+    if (mag) {
+        hfree(mag);
+    }
+}
+
+static
+void
+depot_put_full(int cls, magazine* mag)
+{
+    depot* dd = &(depots[cls]);
+    XLOCK(&(dd->lock), HM_LOCK_OTHER);
+    if (dd->nfull < DEPOT_MAX) {
+        mag->next = dd->full;
+        dd->full = mag;
+        dd->nfull += 1;
+        mag = 0;
+    }
+    XUNLOCK(&(dd->lock));
+
+    if (mag) {
+        // depot's got plenty; the chunks go back to hmem
+        XLAT_SLOW();
+        hfree_batch(mag->items, mag->count);
+        mag->count = 0;
+        depot_put_empty(cls, mag);
+    }
+}
+
+static
+magazine*
+new_magazine(int cls)
+{
+    magazine* mag = depot_get(&(depots[cls].empty), &(depots[cls].nempty), cls);
+    if (!mag) {
+        mag = hmalloc(sizeof(magazine));
+    }
+    mag->count = 0;
+    return mag;
+}
+
+// thread exit: hand whatever we hold to the depots
+static
+void
+tc_flush(void* _arg)
+{
+    for (int cls = 0; cls < TC_CLASSES; ++cls) {
+        magazine* mags[2] = { loaded[cls], previous[cls] };
+        for (int ii = 0; ii < 2; ++ii) {
+            if (!mags[ii]) {
+                continue;
+            }
+            if (mags[ii]->count) {
+                depot_put_full(cls, mags[ii]);
+            }
+            else {
+                depot_put_empty(cls, mags[ii]);
+            }
+        }
+        loaded[cls] = 0;
+        previous[cls] = 0;
+    }
+}
+
+static
+void
+tc_make_key()
+{
+    pthread_key_create(&tc_key, tc_flush);
+}
+
+static
+void
+tc_register()
+{
+    pthread_once(&tc_once, tc_make_key);
+    pthread_setspecific(tc_key, &tc_registered);
+    tc_registered = 1;
+}
+
+static
 void*
-xmalloc(size_t bytes)
+tc_alloc(int cls)
+{
+    magazine* mag = loaded[cls];
+    if (mag && mag->count) {
+        return mag->items[--mag->count];
+    }
+
+    if (previous[cls] && previous[cls]->count) {
+        loaded[cls] = previous[cls];
+        previous[cls] = mag;
+        mag = loaded[cls];
+        return mag->items[--mag->count];
+    }
+
+    if (!tc_registered) {
+        tc_register();
+    }
+    if (tc_gen != __atomic_load_n(&flush_gen, __ATOMIC_RELAXED)) {
+        // a purge asked everyone to give their magazines back
+        tc_gen = __atomic_load_n(&flush_gen, __ATOMIC_RELAXED);
+        tc_flush(0);
+        mag = 0;
+    }
+
+    // both empty: trade one in for a full magazine from the depot
+    XLAT_SLOW();
+    magazine* full = depot_get(&(depots[cls].full), &(depots[cls].nfull), cls);
+    if (full) {
+        if (mag) {
+            depot_put_empty(cls, mag);
+        }
+        loaded[cls] = full;
+        return full->items[--full->count];
+    }
+
+    // depot's dry too: load straight from hmem
+    if (!mag) {
+        mag = new_magazine(cls);
+        loaded[cls] = mag;
+    }
+    mag->count = hmalloc_batch(tc_class_size(cls), mag->items, MAG_SIZE);
+    hmem_grew = 1;
+    return mag->items[--mag->count];
+}
+
+static
+void
+tc_free(int cls, void* ptr)
 {
+    magazine* mag = loaded[cls];
+    if (mag && mag->count < MAG_SIZE) {
+        mag->items[mag->count++] = ptr;
+        return;
+    }
+
+    if (previous[cls] && previous[cls]->count < MAG_SIZE) {
+        loaded[cls] = previous[cls];
+        previous[cls] = mag;
+        mag = loaded[cls];
+        mag->items[mag->count++] = ptr;
+        return;
+    }
+
+    if (!tc_registered) {
+        tc_register();
+    }
+    if (tc_gen != __atomic_load_n(&flush_gen, __ATOMIC_RELAXED)) {
+        tc_gen = __atomic_load_n(&flush_gen, __ATOMIC_RELAXED);
+        tc_flush(0);
+        mag = 0;
+    }
+
+    // both full (or missing): send one to the depot, start a fresh one
+    XLAT_SLOW();
+    if (mag) {
+        if (previous[cls]) {
+            depot_put_full(cls, previous[cls]);
+        }
+        previous[cls] = mag;
+    }
+    mag = new_magazine(cls);
+    loaded[cls] = mag;
+    mag->items[mag->count++] = ptr;
+}
+
+#endif
+
+static
+void*
+small_malloc(size_t bytes)
+{
+#ifndef XM_NO_TCACHE
+    if (bytes <= TC_MAX) {
+        return tc_alloc(tc_class_up(bytes));
+    }
+#endif
+    hmem_grew = 1;
     return hmalloc(bytes);
 }
 
+static
+void
+maybe_relieve()
+{
+    hmem_grew = 0;
+    if (xpressure_due(hmapped_bytes())) {
+        xpressure_relieve(xmalloc_purge, xmalloc_footprint);
+    }
+}
+
+void*
+(xmalloc)(size_t bytes)
+{
+    XLAT_START(t0);
+    void* ptr = small_malloc(bytes);
+    if (__builtin_expect(hmem_grew, 0)) {
+        maybe_relieve();
+    }
+    XLAT_END(t0, XLAT_MALLOC, bytes);
+    return ptr;
+}
+
 void
 xfree(void* ptr)
 {
-    hfree(ptr);
+    XLAT_START(t0);
+#ifndef XM_NO_TCACHE
+    size_t size = husable_size(ptr);
+    if (size >= tc_class_size(0) && size < 2 * TC_MAX) {
+        tc_free(tc_class_down(size), ptr);
+    }
+    else
+#else
+    XLAT_SIZE(size, husable_size(ptr));
+#endif
+    {
+        hfree(ptr);
+    }
+    XLAT_END(t0, XLAT_FREE, size);
+}
+
+void*
+xcalloc(size_t nn, size_t bytes)
+{
+    XLAT_START(t0);
+    void* ptr;
+    size_t total;
+    if (!__builtin_mul_overflow(nn, bytes, &total) && total <= TC_MAX) {
+        // cached chunks are recycled, so always dirty
+        ptr = small_malloc(total);
+        memset(ptr, 0, total);
+    }
+    else {
+        // hcalloc knows which chunks are fresh mappings
+        ptr = hcalloc(nn, bytes);
+        hmem_grew = 1;
+    }
+    if (hmem_grew) {
+        maybe_relieve();
+    }
+    XLAT_END(t0, XLAT_MALLOC, nn * bytes);
+    return ptr;
+}
+
+size_t
+xmalloc_usable_size(void* ptr)
+{
+    return husable_size(ptr);
+}
+
+void*
+xmalloc_at_least(size_t bytes, size_t* actual)
+{
+    void* ptr = xmalloc(bytes);
+    *actual = husable_size(ptr);
+    return ptr;
+}
+
+void*
+xmalloc_hint(size_t bytes, int hint)
+{
+    // hmem has one free list for everything
+    return xmalloc(bytes);
+}
+
+long
+xmalloc_reserve(size_t bytes, long count)
+{
+    if (count <= 0 || (size_t)count > SIZE_MAX / sizeof(void*)) {
+        return 0;
+    }
+
+    // no way to set chunks aside; allocating and freeing them at least
+    // leaves the memory mapped and faulted in where hmem keeps it
+    void** items = hmalloc(count * sizeof(void*));
+    if (!items) {
+        return 0;
+    }
+    long got = 0;
+    while (got < count && (items[got] = xmalloc(bytes))) {
+        memset(items[got], 0, bytes);
+        got++;
+    }
+    for (long ii = got - 1; ii >= 0; --ii) {
+        xfree(items[ii]);
+    }
+    hfree(items);
+    return got;
 }
 
 void*
 xrealloc(void* prev, size_t bytes)
 {
-    return hrealloc(prev, bytes);
+    XLAT_START(t0);
+    void* ptr = hrealloc(prev, bytes);
+    maybe_relieve();
+    XLAT_END(t0, XLAT_REALLOC, bytes);
+    return ptr;
+}
+
+size_t
+xmalloc_purge()
+{
+#ifndef XM_NO_TCACHE
+    tc_flush(0);
+    __atomic_add_fetch(&flush_gen, 1, __ATOMIC_RELAXED);
+    tc_gen = __atomic_load_n(&flush_gen, __ATOMIC_RELAXED);
+
+    // empty the depots into hmem
+    for (int cls = 0; cls < TC_CLASSES; ++cls) {
+        depot* dd = &(depots[cls]);
+        XLOCK(&(dd->lock), HM_LOCK_OTHER);
+        magazine* full = dd->full;
+        magazine* empty = dd->empty;
+        dd->full = dd->empty = 0;
+        dd->nfull = dd->nempty = 0;
+        XUNLOCK(&(dd->lock));
+
+        while (full) {
+            magazine* next = full->next;
+            hfree_batch(full->items, full->count);
+            hfree(full);
+            full = next;
+        }
+        while (empty) {
+            magazine* next = empty->next;
+            hfree(empty);
+            empty = next;
+        }
+    }
+#endif
+    return hpurge();
+}
+
+size_t
+xmalloc_footprint()
+{
+    return hmapped_bytes();
+}
+
+void
+xmalloc_flush()
+{
+#ifndef XM_NO_TCACHE
+    // the magazines go to the depots, where any thread can take them
+    tc_flush(0);
+#endif
+}
+
+static
+void
+count_free(void* chunk, size_t size, void* arg)
+{
+    xheap_info* info = (xheap_info*)arg;
+    int bucket = size > XM_MAX_SMALL ? XM_BUCKETS - 1 : xm_bucket(size);
+    info->classes[bucket].free += 1;
+    info->free_bytes += size;
+}
+
+// hmem keeps one address-ordered free list rather than slabs, so this
+// only fills in free chunks by class and the depots' magazines, which
+// count as free lists of their class. chunks sitting in other threads'
+// loaded magazines can't be seen and count as live.
+void
+xheap_stats(xheap_info* info)
+{
+    memset(info, 0, sizeof(xheap_info));
+    info->backend = "hw7";
+    for (int ii = 0; ii < XM_BUCKETS; ++ii) {
+        info->classes[ii].size = xm_bucket_size(ii);
+    }
+
+    hwalk(count_free, info);
+
+#ifndef XM_NO_TCACHE
+    for (int cls = 0; cls < TC_CLASSES; ++cls) {
+        depot* dd = &(depots[cls]);
+        xheap_class* xc = &(info->classes[xm_bucket(tc_class_size(cls) + sizeof(size_t))]);
+        XLOCK(&(dd->lock), HM_LOCK_OTHER);
+        for (magazine* mag = dd->full; mag; mag = mag->next) {
+            for (long ii = 0; ii < mag->count; ++ii) {
+                info->free_bytes += husable_size(mag->items[ii]) + sizeof(size_t);
+            }
+            xc->free += mag->count;
+            xc->lists += 1;
+            if (mag->count) {
+                xc->list_len[63 - __builtin_clzl(mag->count)] += 1;
+            }
+            if (mag->count > xc->list_max) {
+                xc->list_max = mag->count;
+            }
+        }
+        XUNLOCK(&(dd->lock));
+    }
+#endif
+
+    hm_stats* stats = hgetstats();
+    hlarge_stats(&(info->large), &(info->large_bytes));
+    info->large_requested = info->large_bytes - info->large * sizeof(size_t);
+    info->mapped_bytes = (stats->pages_mapped - stats->pages_unmapped) * (size_t)4096;
+    info->live_bytes = info->mapped_bytes - info->free_bytes;
+    info->slab_size = 4096;
+    info->rss_bytes = xheap_rss();
 }
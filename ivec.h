@@ -2,8 +2,10 @@
 #define IVEC_H
 
 #include <assert.h>
+#include <pthread.h>
 
 #include "xmalloc.h"
+#include "xcache.h"
 
 typedef struct ivec {
     long  cap;
@@ -11,16 +13,53 @@ typedef struct ivec {
     long* data;
 } ivec;
 
+// ivecs come from an xcache, and go back to it with their data buffer
+// still attached, so most make_ivecs are one pop. buffers that grew
+// past IVEC_KEEP longs are swapped for a small one first, so the cache
+// doesn't hang on to big ones.
+#define IVEC_CAP0 4
+#define IVEC_KEEP 64
+
+static xcache* ivec_cache;
+static pthread_once_t ivec_once = PTHREAD_ONCE_INIT;
+
+static
+void
+ivec_ctor(void* obj)
+{
+    size_t bytes;
+    ivec* xs = obj;
+    xs->size = 0;
+    xs->data = xmalloc_at_least(IVEC_CAP0 * sizeof(long), &bytes);
+    xs->cap  = bytes / sizeof(long); // use the whole chunk
+}
+
+static
+void
+ivec_dtor(void* obj)
+{
+    xfree(((ivec*)obj)->data);
+}
+
+static
+void
+ivec_make_cache()
+{
+    ivec_cache = xcache_create(sizeof(ivec), 0, ivec_ctor, ivec_dtor);
+}
+
 static
 ivec*
 make_ivec(int cap0)
 {
     assert(cap0 > 0);
 
-    ivec* xs = xmalloc(sizeof(ivec));
-    xs->cap  = cap0;
-    xs->size = 0;
-    xs->data = xmalloc(xs->cap * sizeof(long));
+    pthread_once(&ivec_once, ivec_make_cache);
+    ivec* xs = xcache_alloc(ivec_cache);
+    if (xs->cap < cap0) {
+        xs->data = xrealloc(xs->data, cap0 * sizeof(long));
+        xs->cap  = xmalloc_usable_size(xs->data) / sizeof(long);
+    }
     return xs;
 }
 
@@ -28,8 +67,12 @@ static
 void
 free_ivec(ivec* xs)
 {
-    xfree(xs->data);
-    xfree(xs);
+    if (xs->cap > IVEC_KEEP) {
+        xfree(xs->data);
+        ivec_ctor(xs);
+    }
+    xs->size = 0;
+    xcache_free(ivec_cache, xs);
 }
 
 static
@@ -37,8 +80,8 @@ void
 ivec_push(ivec* xs, long item)
 {
     if (xs->size >= xs->cap) {
-        xs->cap *= 2;
-        xs->data = xrealloc(xs->data, xs->cap * sizeof(long));
+        xs->data = xrealloc(xs->data, 2 * xs->cap * sizeof(long));
+        xs->cap  = xmalloc_usable_size(xs->data) / sizeof(long);
     }
 
     xs->data[xs->size] = item;
@@ -0,0 +1,221 @@
+
+// Fits par's size classes to a size profile.
+//
+//   XMALLOC_SIZES=sizes.txt ./collatz-list-par 10000
+//   ./mkclasses -n 11 sizes.txt > xclasses.h
+//   make clean all CPPFLAGS=-DXM_CLASSES
+//
+// The profile is what par writes with $XMALLOC_SIZES: lines of "SIZE
+// COUNT", true sizes in multiples of 16, and # comments. We pick at
+// most N class sizes (default 11), the last always 64K, that minimize
+// the expected bytes wasted per allocation: the gap between a request
+// and its class, plus the class's share of the tail of its 64K slab
+// that no chunk fits in. That's a dynamic program over the sizes seen,
+// since an optimal class boundary always sits on one of them. The
+// output is an xclasses.h with the class sizes and the size-to-class
+// lookup table xmalloc.h indexes for -DXM_CLASSES.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SLAB      65536 // par's slab, and the biggest class
+#define GRAIN     16    // class sizes are multiples of this
+#define MAX_SIZES (SLAB / GRAIN)
+#define MAX_CLASSES 64  // par keeps a slab's class in a byte, per pool
+
+static double counts[MAX_SIZES + 1]; // by size / GRAIN
+
+// sizes seen, ascending, with SLAB last; prefix sums for the cost
+static long sizes[MAX_SIZES + 1];
+static double wsum[MAX_SIZES + 2]; // counts
+static double ssum[MAX_SIZES + 2]; // counts * sizes
+static int nsizes = 0;
+
+static
+double
+slab_tail(long size)
+{
+    long per = SLAB / size;
+    return (double)(SLAB - per * size) / per;
+}
+
+// bytes wasted if sizes[jj..ii] all go to a class of sizes[ii]
+static
+double
+cost(int jj, int ii)
+{
+    double ww = wsum[ii + 1] - wsum[jj];
+    double ss = ssum[ii + 1] - ssum[jj];
+    return ww * (sizes[ii] + slab_tail(sizes[ii])) - ss;
+}
+
+// waste with the given classes, for the comparison in the header
+static
+double
+waste_with(long* classes, int nclasses)
+{
+    double waste = 0;
+    for (int ii = 0; ii < nsizes; ++ii) {
+        int cc = 0;
+        while (cc < nclasses - 1 && classes[cc] < sizes[ii]) {
+            cc++;
+        }
+        double ww = wsum[ii + 1] - wsum[ii];
+        waste += ww * (classes[cc] + slab_tail(classes[cc]) - sizes[ii]);
+    }
+    return waste;
+}
+
+static
+void
+load(const char* path, double* large)
+{
+    FILE* fh = fopen(path, "r");
+    if (!fh) {
+        perror(path);
+        exit(1);
+    }
+
+    char line[256];
+    while (fgets(line, sizeof(line), fh)) {
+        long size;
+        double count;
+        if (sscanf(line, "# bigger than %*d: %lf", &count) == 1) {
+            *large += count;
+        }
+        if (line[0] == '#' || sscanf(line, "%ld %lf", &size, &count) != 2) {
+            continue;
+        }
+        if (size <= 0 || size > SLAB) {
+            *large += count;
+            continue;
+        }
+        counts[(size + GRAIN - 1) / GRAIN] += count;
+    }
+    fclose(fh);
+}
+
+int
+main(int argc, char* argv[])
+{
+    int nclasses = 11;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt != 'n' || (nclasses = atoi(optarg)) < 1 || nclasses > MAX_CLASSES) {
+            argc = 0;
+            break;
+        }
+    }
+    if (argc == 0 || optind != argc - 1) {
+        fprintf(stderr, "Usage:\n");
+        fprintf(stderr, "\t%s [-n CLASSES] PROFILE > xclasses.h\n", argv[0]);
+        fprintf(stderr, "\t(1 to %d classes, default 11)\n", MAX_CLASSES);
+        return 1;
+    }
+
+    double large = 0;
+    load(argv[optind], &large);
+
+    // every class is a multiple of GRAIN, so at least a free-list node
+    for (long gg = 1; gg <= MAX_SIZES; ++gg) {
+        long size = gg * GRAIN;
+        if (counts[gg] > 0 || size == SLAB) {
+            sizes[nsizes] = size;
+            wsum[nsizes + 1] = wsum[nsizes] + counts[gg];
+            ssum[nsizes + 1] = ssum[nsizes] + counts[gg] * size;
+            nsizes++;
+        }
+    }
+    if (wsum[nsizes] == 0) {
+        fprintf(stderr, "%s: no small requests in the profile\n", argv[optind]);
+        return 1;
+    }
+    if (nclasses > nsizes) {
+        nclasses = nsizes;
+    }
+
+    // best[kk][ii]: least waste covering sizes[0..ii] with kk + 1
+    // classes, the biggest being sizes[ii]; from[kk][ii] is where that
+    // last class's range starts
+    double* best = malloc(sizeof(double) * nclasses * nsizes);
+    int* from = malloc(sizeof(int) * nclasses * nsizes);
+    for (int ii = 0; ii < nsizes; ++ii) {
+        best[ii] = cost(0, ii);
+        from[ii] = 0;
+    }
+    for (int kk = 1; kk < nclasses; ++kk) {
+        double* prev = &(best[(kk - 1) * nsizes]);
+        double* cur = &(best[kk * nsizes]);
+        for (int ii = 0; ii < nsizes; ++ii) {
+            cur[ii] = prev[ii];
+            from[kk * nsizes + ii] = -1; // fewer classes did as well
+            for (int jj = kk; jj <= ii; ++jj) {
+                double cc = prev[jj - 1] + cost(jj, ii);
+                if (cc < cur[ii]) {
+                    cur[ii] = cc;
+                    from[kk * nsizes + ii] = jj;
+                }
+            }
+        }
+    }
+
+    long classes[MAX_CLASSES];
+    int nn = 0;
+    int ii = nsizes - 1;
+    for (int kk = nclasses - 1; kk >= 0 && ii >= 0; --kk) {
+        int jj = from[kk * nsizes + ii];
+        if (jj < 0) {
+            continue;
+        }
+        classes[nn++] = sizes[ii];
+        ii = jj - 1;
+    }
+    // collected biggest first
+    for (int aa = 0, bb = nn - 1; aa < bb; ++aa, --bb) {
+        long tmp = classes[aa];
+        classes[aa] = classes[bb];
+        classes[bb] = tmp;
+    }
+
+    long pow2[11];
+    for (int kk = 0; kk < 11; ++kk) {
+        pow2[kk] = 64L << kk;
+    }
+    double total = wsum[nsizes];
+    double bytes = ssum[nsizes];
+    double waste = waste_with(classes, nn);
+    double waste_pow2 = waste_with(pow2, 11);
+
+    printf("#ifndef XCLASSES_H\n#define XCLASSES_H\n\n");
+    printf("// Size classes for -DXM_CLASSES, generated by mkclasses from %s.\n", argv[optind]);
+    printf("// %.0f small requests, %.0f large. Expected waste per request:\n", total, large);
+    printf("// %.1f bytes (%.1f%%), against %.1f bytes (%.1f%%) for powers of two.\n\n",
+           waste / total, 100 * waste / bytes, waste_pow2 / total, 100 * waste_pow2 / bytes);
+
+    printf("#define XM_BUCKETS     %d\n", nn);
+    printf("#define XM_MAX_SMALL   ((size_t)%d)\n", SLAB);
+    printf("#define XM_CLASS_GRAIN %d\n\n", GRAIN);
+
+    printf("#define XM_CLASS_SIZES {");
+    for (int kk = 0; kk < nn; ++kk) {
+        printf("%s %ld", kk ? "," : "", classes[kk]);
+    }
+    printf(" }\n\n");
+
+    // class for each (true size - 1) / GRAIN
+    printf("#define XM_CLASS_INDEX { \\\n");
+    int cc = 0;
+    for (long gg = 0; gg < MAX_SIZES; ++gg) {
+        while (classes[cc] < (gg + 1) * GRAIN) {
+            cc++;
+        }
+        printf("%s%d,%s", gg % 32 ? " " : "    ", cc, gg % 32 == 31 ? " \\\n" : "");
+    }
+    printf("}\n\n#endif\n");
+
+    free(best);
+    free(from);
+    return 0;
+}
@@ -6,21 +6,136 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <string.h>
-#include <math.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <signal.h>
+#include <execinfo.h>
 
 
 #include "xmalloc.h"
+#include "xlat.h"
+#include "xcopy.h"
+#include "xpressure.h"
 
-typedef struct list_node {
-   size_t size;
-   struct list_node* next;
-} list_node;
+typedef xm_node list_node;
 
 //const size_t PAGE_SIZE = 4096;
-const size_t PAGE_SIZE = 65536; // more than a page
+static const size_t PAGE_SIZE = 65536; // more than a page
 static hm_stats stats; // This initializes the stats to 0.
 
-static __thread list_node* heads[11] = {0}; // buckets
+/*
+mid-size documentation:
+chunks over PAGE_SIZE but no more than MID_MAX bytes are runs of
+PAGE_SIZE units carved out of SEG_SIZE segments, instead of each getting
+its own mmap. segments are aligned to SEG_SIZE, so a chunk's segment is
+its address rounded down. unit 0 of every segment holds the segment
+header, which tracks used units in a bitmap; freeing a run just clears
+its bits, so neighbouring free runs coalesce for free.
+
+bucket slabs are single-unit runs from the same segments, so
+everything below MID_MAX can be found by walking the segment list. the
+header also records what each unit is for, for xheap_stats.
+
+all of this is shared between threads under runs_lock.
+*/
+#define SEG_SIZE  ((size_t)16 << 20)
+#define SEG_UNITS (SEG_SIZE / 65536)
+#define MID_MAX   ((size_t)4 << 20)
+
+#define UNIT_FREE     0
+#define UNIT_HEADER   1
+#define UNIT_RUN      2 // first unit of a mid-size run
+#define UNIT_RUN_TAIL 3
+#define UNIT_SLAB     16 // + XM_BUCKETS * pool + bucket
+
+typedef struct segment {
+    struct segment* next;
+    long index;
+    long nfree;
+    uint64_t used[SEG_UNITS / 64];  // unit handed out
+    uint64_t dirty[SEG_UNITS / 64]; // unit handed out since mapped or purged
+    uint8_t kind[SEG_UNITS];        // UNIT_*
+} segment;
+
+static segment* segments = 0;
+static long nsegments = 0;
+static long dirty_units = 0; // across all segments; the footprint
+static pthread_mutex_t runs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+large documentation:
+chunks over MID_MAX get their own mapping, which starts with a
+large_hdr linking it into the list of large mappings, followed by the
+usual size word. the size word holds the size of the whole mapping.
+*/
+typedef struct large_hdr {
+    struct large_hdr* next;
+    struct large_hdr* prev;
+    size_t requested;
+} large_hdr;
+
+static large_hdr* larges = 0;
+static size_t large_mapped = 0; // atomic
+static pthread_mutex_t large_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+lifetime pools:
+xmalloc_hint(size, XM_LONG_LIVED) carves from its own slabs, with its
+own free lists, so long-lived chunks don't pin slabs full of short-lived
+ones. everything else is pool 0. a slab's pool is part of its unit kind,
+so xfree can tell where a chunk goes back to.
+*/
+#define POOL_SHORT 0
+#define POOL_LONG  1
+#define POOLS      2
+
+__thread list_node* xm_heads[XM_BUCKETS] = {0}; // buckets, see xmalloc.h
+static __thread list_node* long_heads[XM_BUCKETS] = {0};
+
+// the untouched tail of each bucket's newest slab. chunks carved from
+// here have never been handed out, so they're still zero from mmap.
+static __thread void* fresh[POOLS][XM_BUCKETS] = {{0}};
+static __thread void* fresh_end[POOLS][XM_BUCKETS] = {{0}};
+// false when the newest slab is a recycled unit, and has to be zeroed
+static __thread int fresh_zero[POOLS][XM_BUCKETS] = {{0}};
+
+/*
+central lists:
+thread lists never shrink on their own. when memory gets tight (see
+xmalloc_purge) threads flush their lists here, where chunks from every
+thread meet up and whole free slabs can be found and given back. a
+thread that runs dry takes a batch from here before carving a new slab.
+flush_gen is bumped on every purge; threads compare it to their own on
+their next refill and flush then.
+*/
+#define CENTRAL_BATCH 64
+
+static list_node* central[POOLS][XM_BUCKETS];
+static pthread_mutex_t central_lock = PTHREAD_MUTEX_INITIALIZER;
+static long flush_gen = 0;
+static __thread long my_flush_gen = 0;
+
+/*
+every thread that caches chunks registers a tcache_ref so xheap_stats
+can find its free lists. when the thread exits its lists are copied
+into the ref and stay there, orphaned.
+*/
+typedef struct tcache_ref {
+    struct tcache_ref* next;
+    list_node** heads[POOLS];
+    void* (*fresh)[XM_BUCKETS];
+    void* (*fresh_end)[XM_BUCKETS];
+    list_node* orphan_heads[POOLS][XM_BUCKETS];
+    void* orphan_fresh[POOLS][XM_BUCKETS];
+    void* orphan_fresh_end[POOLS][XM_BUCKETS];
+} tcache_ref;
+
+static __thread tcache_ref* my_ref = 0;
+static tcache_ref* refs = 0;
+static pthread_mutex_t refs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t refs_key;
+static pthread_once_t refs_once = PTHREAD_ONCE_INIT;
 
 /*
 bucket documentation:
@@ -35,8 +150,26 @@ user size: true_size - sizeof(list_node);
 this is because 2^6 == 64, which we've chosen as the smallest
 bucket.
 
+built with -DXM_CLASSES the sizes come from xclasses.h instead (see
+size profile documentation below). they're multiples of 16 and the
+last one is still a whole 64K slab.
+
+coloring:
+slabs are 64K aligned, so chunk 0 of every slab lands in the same
+cache sets, and so does chunk 1, and so on. for buckets up to
+COLOR_MAX each slab gives up COLOR_SLACK bytes (or one chunk, if that's
+bigger) and starts carving at a multiple of 64 bytes into that slack,
+picked by the slab's unit number. neighbouring slabs then start on
+different cache lines. that costs at most 1/32 of a slab; bigger
+buckets would lose too much and aren't colored. build with
+-DXM_NO_COLOR to turn it off.
+
 */
 
+#define COLOR_LINE  64
+#define COLOR_SLACK 1024
+#define COLOR_MAX   2048
+
 static
 size_t
 div_up(size_t xx, size_t yy)
@@ -58,26 +191,21 @@ int
 conv_size_bucket(size_t size)
 {
     // find the index to be used
-    int bucket = ceil(log(size)/log(2)) - 6;
-    if (bucket < 0)
-    {
-        bucket = 0;
-    }
-    return bucket;
+    return xm_bucket(size);
 }
 
 static
 int
 conv_bucket_size(int bucket)
 {
-    return 1 << (bucket + 6);
+    return xm_bucket_size(bucket);
 }
 
 static
 void
 print_bucket(int ii)
 {
-    for (list_node* curr = heads[ii]; curr && curr->next; curr = curr->next) {
+    for (list_node* curr = xm_heads[ii]; curr && curr->next; curr = curr->next) {
       printf("{%p}\n", curr);
     }
     printf("\n");
@@ -87,44 +215,337 @@ static
 void
 print_heads()
 {
-    for (int ii = 0; ii < 11; ++ii) {
-      printf("head %p\n", heads[ii]);
+    for (int ii = 0; ii < XM_BUCKETS; ++ii) {
+      printf("head %p\n", xm_heads[ii]);
       // print_bucket(ii);
     }
     printf("\n");
 }
 
-// fills the given bucket with chunks of the right size
+static
+int
+bit_get(uint64_t* map, long ii)
+{
+    return (map[ii / 64] >> (ii % 64)) & 1;
+}
+
+static
+void
+bits_set(uint64_t* map, long start, long count, int val)
+{
+    for (long ii = start; ii < start + count; ++ii)
+    {
+        if (val)
+        {
+            map[ii / 64] |= (uint64_t)1 << (ii % 64);
+        }
+        else
+        {
+            map[ii / 64] &= ~((uint64_t)1 << (ii % 64));
+        }
+    }
+}
+
+// marks units dirty, keeping dirty_units up to date. returns how many
+// weren't dirty already. call with runs_lock held.
+static
+long
+mark_dirty(segment* seg, long start, long count)
+{
+    long clean = 0;
+    for (long ii = start; ii < start + count; ++ii)
+    {
+        clean += !bit_get(seg->dirty, ii);
+    }
+    bits_set(seg->dirty, start, count, 1);
+    dirty_units += clean;
+    return clean;
+}
+
+static
+segment*
+new_segment()
+{
+    // over-map so we can trim down to an aligned segment
+    void* raw = mmap(NULL, 2 * SEG_SIZE, PROT_READ|PROT_WRITE,
+        MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if((long)raw == -1)
+    {
+        perror("mapping segment");
+        return 0;
+    }
+
+    void* base = (void*)(((uintptr_t)raw + SEG_SIZE - 1) & ~(SEG_SIZE - 1));
+    if (base > raw)
+    {
+        munmap(raw, base - raw);
+    }
+    munmap(base + SEG_SIZE, (raw + 2 * SEG_SIZE) - (base + SEG_SIZE));
+
+    __atomic_add_fetch(&stats.pages_mapped, SEG_SIZE / 4096, __ATOMIC_RELAXED);
+
+    segment* seg = (segment*)base;
+    seg->index = nsegments++;
+    seg->nfree = SEG_UNITS - 1;
+    bits_set(seg->used, 0, 1, 1); // the header's unit
+    mark_dirty(seg, 0, 1);
+    seg->kind[0] = UNIT_HEADER;
+    seg->next = segments;
+    segments = seg;
+    return seg;
+}
+
+// first fit run of count free units in seg, or -1
+static
+long
+find_run(segment* seg, long count)
+{
+    long run = 0;
+    for (long ii = 1; ii < (long)SEG_UNITS; ++ii)
+    {
+        if (bit_get(seg->used, ii))
+        {
+            run = 0;
+            continue;
+        }
+        if (++run == count)
+        {
+            return ii - count + 1;
+        }
+    }
+    return -1;
+}
+
+// hands out count contiguous units marked kind. *zeroed is set
+// if none of them were ever handed out before.
+static
+void*
+run_alloc(long units, int kind, int* zeroed, int op)
+{
+    segment* seg;
+    long start = -1;
+
+    XLOCK(&runs_lock, op);
+    for (seg = segments; seg; seg = seg->next)
+    {
+        if (seg->nfree >= units && (start = find_run(seg, units)) >= 0)
+        {
+            break;
+        }
+    }
+    if (!seg)
+    {
+        XLAT_SLOW();
+        seg = new_segment();
+        if (!seg)
+        {
+            XUNLOCK(&runs_lock);
+            return 0;
+        }
+        start = 1;
+    }
+
+    *zeroed = mark_dirty(seg, start, units) == units;
+    bits_set(seg->used, start, units, 1);
+    memset(&(seg->kind[start]), kind == UNIT_RUN ? UNIT_RUN_TAIL : kind, units);
+    seg->kind[start] = kind;
+    seg->nfree -= units;
+    XUNLOCK(&runs_lock);
+
+    return (void*)seg + start * PAGE_SIZE;
+}
+
+static
+void*
+mid_malloc(size_t size, int* zeroed)
+{
+    // here, the size is the true size we need.
+    long units = div_up(size, PAGE_SIZE);
+
+    list_node* chunk = run_alloc(units, UNIT_RUN, zeroed, HM_LOCK_MALLOC);
+    if (!chunk)
+    {
+        return 0;
+    }
+    chunk->size = units * PAGE_SIZE;
+    return (void*)chunk + sizeof(size_t);
+}
+
 static
 void
-fill_bucket(int bucket)
+mid_free(list_node* chunk)
+{
+    segment* seg = (segment*)((uintptr_t)chunk & ~(SEG_SIZE - 1));
+    long start = ((void*)chunk - (void*)seg) / PAGE_SIZE;
+    long units = chunk->size / PAGE_SIZE;
+
+    XLOCK(&runs_lock, HM_LOCK_FREE);
+    bits_set(seg->used, start, units, 0);
+    memset(&(seg->kind[start]), UNIT_FREE, units);
+    seg->nfree += units;
+    XUNLOCK(&runs_lock);
+}
+
+// tries to extend a run in place; true if it did
+static
+int
+mid_grow(list_node* chunk, size_t size)
+{
+    segment* seg = (segment*)((uintptr_t)chunk & ~(SEG_SIZE - 1));
+    long start = ((void*)chunk - (void*)seg) / PAGE_SIZE;
+    long units = chunk->size / PAGE_SIZE;
+    long want = div_up(size, PAGE_SIZE);
+    int ok = 1;
+
+    if (start + want > (long)SEG_UNITS)
+    {
+        return 0;
+    }
+
+    XLOCK(&runs_lock, HM_LOCK_REALLOC);
+    for (long ii = start + units; ii < start + want; ++ii)
+    {
+        if (bit_get(seg->used, ii))
+        {
+            ok = 0;
+            break;
+        }
+    }
+    if (ok)
+    {
+        bits_set(seg->used, start + units, want - units, 1);
+        mark_dirty(seg, start + units, want - units);
+        memset(&(seg->kind[start + units]), UNIT_RUN_TAIL, want - units);
+        seg->nfree -= want - units;
+        chunk->size = want * PAGE_SIZE;
+    }
+    XUNLOCK(&runs_lock);
+    return ok;
+}
+
+static void register_thread();
+static void flush_thread();
+static list_node* take_central(int bucket, int pool);
+static void maybe_relieve();
+
+// bytes at the start of every slab of this bucket set aside for coloring
+static
+size_t
+slab_slack(int bucket)
+{
+#ifdef XM_NO_COLOR
+    return 0;
+#else
+    size_t size = conv_bucket_size(bucket);
+    if (size > COLOR_MAX)
+    {
+        return 0;
+    }
+    return size < COLOR_SLACK ? COLOR_SLACK : size;
+#endif
+}
+
+// chunks a slab of this bucket holds
+static
+long
+slab_chunks(int bucket)
+{
+    return (PAGE_SIZE - slab_slack(bucket)) / conv_bucket_size(bucket);
+}
+
+// where carving starts in the slab at addr
+static
+size_t
+slab_color(void* addr, int bucket)
+{
+    size_t colors = slab_slack(bucket) / COLOR_LINE;
+    if (!colors)
+    {
+        return 0;
+    }
+    long unit = ((uintptr_t)addr & (SEG_SIZE - 1)) / PAGE_SIZE;
+    return (unit % colors) * COLOR_LINE;
+}
+
+static inline
+list_node**
+pool_heads(int pool)
+{
+    return pool == POOL_LONG ? long_heads : xm_heads;
+}
+
+// gives the given bucket a new slab to carve chunks from. returns 0,
+// leaving the bucket empty, if there's no memory for one.
+static
+int
+fill_bucket(int bucket, int pool)
+{
+    int zeroed;
+    void* new_space = run_alloc(1, UNIT_SLAB + XM_BUCKETS * pool + bucket, &zeroed, HM_LOCK_MALLOC);
+    if (!new_space)
+    {
+        // new_segment already said why
+        return 0;
+    }
+
+    XLAT_SLOW();
+
+    // chunks are carved lazily in take_chunk, so the slab's pages
+    // only get faulted in as they're used
+    fresh[pool][bucket] = new_space + slab_color(new_space, bucket);
+    fresh_end[pool][bucket] = fresh[pool][bucket] + slab_chunks(bucket) * conv_bucket_size(bucket);
+    fresh_zero[pool][bucket] = zeroed;
+    return 1;
+}
+
+// pops a chunk for the given bucket and pool, preferring recycled
+// chunks. *zeroed is set if the chunk came straight from a fresh slab.
+// returns 0 if there's nothing recycled and no memory for a new slab.
+static inline
+list_node*
+take_chunk(int bucket, int pool, int* zeroed)
 {
     size_t bucket_true_space = conv_bucket_size(bucket);
+    list_node** heads = pool_heads(pool);
+    list_node* chunk = heads[bucket];
 
-    void* new_space = mmap(NULL,
-        PAGE_SIZE, PROT_READ|PROT_WRITE|PROT_EXEC,
-        MAP_SHARED|MAP_ANONYMOUS, -1, 0);
-    if((long)new_space == -1)
+    if (chunk)
     {
-        perror("filling bucket");
+        heads[bucket] = chunk->next;
+        *zeroed = 0;
+        return chunk;
     }
 
-    int num_chunks = PAGE_SIZE / bucket_true_space;
-    for (int ii = 0; ii < num_chunks; ii++)
+    if (fresh[pool][bucket] + bucket_true_space > fresh_end[pool][bucket])
     {
-        list_node* new_node = (list_node*)(new_space + ii * bucket_true_space);
-        new_node->size = bucket_true_space;
-        if (ii == num_chunks - 1)
+        if (!my_ref)
         {
-             // last new_node has null pointer
-             new_node->next = 0;
+            register_thread();
         }
-        else
+        if (__atomic_load_n(&flush_gen, __ATOMIC_RELAXED) != my_flush_gen)
+        {
+            flush_thread();
+        }
+        if (__atomic_load_n(&(central[pool][bucket]), __ATOMIC_RELAXED))
+        {
+            chunk = take_central(bucket, pool);
+            if (chunk)
+            {
+                *zeroed = 0;
+                return chunk;
+            }
+        }
+        if (!fill_bucket(bucket, pool))
         {
-            new_node->next = (list_node*)(new_space + (ii + 1) * bucket_true_space);
+            return 0;
         }
+        maybe_relieve();
     }
-    heads[bucket] = (list_node*)new_space;
+
+    chunk = (list_node*)fresh[pool][bucket];
+    fresh[pool][bucket] += bucket_true_space;
+    *zeroed = fresh_zero[pool][bucket];
+    return chunk;
 }
 
 static
@@ -132,129 +553,1538 @@ void*
 hmalloc_large(size_t size)
 {
     // here, the size is the true size we need.
+    size_t requested = size - sizeof(size_t);
+    size += sizeof(large_hdr);
 
     int num_pages = div_up(size, PAGE_SIZE);
 
+    XLAT_SLOW();
+    __atomic_add_fetch(&stats.pages_mapped, num_pages * (PAGE_SIZE / 4096), __ATOMIC_RELAXED);
+
     // mmap enough pages for the big thing
     void* new_addr = mmap(NULL,
         num_pages * PAGE_SIZE,
-        PROT_READ|PROT_WRITE|PROT_EXEC,
-        MAP_SHARED|MAP_ANONYMOUS,-1, 0);
+        PROT_READ|PROT_WRITE,
+        MAP_PRIVATE|MAP_ANONYMOUS,-1, 0);
 
     if((long)new_addr == -1)
     {
         perror("mapping new LARGE page");
+        return 0;
+    }
+
+    __atomic_add_fetch(&large_mapped, num_pages * PAGE_SIZE, __ATOMIC_RELAXED);
+
+    large_hdr* hdr = (large_hdr*)new_addr;
+    hdr->requested = requested;
+    hdr->prev = 0;
+    XLOCK(&large_lock, HM_LOCK_MALLOC);
+    hdr->next = larges;
+    if (larges)
+    {
+        larges->prev = hdr;
     }
+    larges = hdr;
+    XUNLOCK(&large_lock);
 
-    list_node* new_chunk = (list_node*)new_addr;
+    list_node* new_chunk = (list_node*)(hdr + 1);
     // set its size
     new_chunk->size = num_pages * PAGE_SIZE;
-    new_chunk->next = 0;
-
 
-    return new_addr + sizeof(size_t);
+    return (void*)new_chunk + sizeof(size_t);
 }
 
-
-void*
-xmalloc(size_t bytes)
+static
+void
+free_large(list_node* chunk)
 {
-    size_t true_bytes = bytes + sizeof(size_t);
+    large_hdr* hdr = (large_hdr*)chunk - 1;
 
-    // handle mapping for large chunks
-    if (bytes > PAGE_SIZE)
+    XLOCK(&large_lock, HM_LOCK_FREE);
+    if (hdr->prev)
     {
-        //mmap the entire page.
-        return hmalloc_large(true_bytes);
+        hdr->prev->next = hdr->next;
     }
+    else
+    {
+        larges = hdr->next;
+    }
+    if (hdr->next)
+    {
+        hdr->next->prev = hdr->prev;
+    }
+    XUNLOCK(&large_lock);
 
-    int bucket = conv_size_bucket(true_bytes);
-
-    if(!heads[bucket])
+    XLAT_SLOW();
+    __atomic_add_fetch(&stats.pages_unmapped, chunk->size / 4096, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&large_mapped, chunk->size, __ATOMIC_RELAXED);
+    //unmap the page divided up
+    int rv = munmap(hdr, chunk->size);
+    if (rv == -1)
     {
-        fill_bucket(bucket);
+        perror("unmapping large page");
     }
+}
 
-    void* mem_addr = (void*)heads[bucket];
-    heads[bucket] = heads[bucket]->next;
+// usable bytes in a chunk of any kind
+static
+size_t
+chunk_usable(list_node* chunk)
+{
+    if (chunk->size > MID_MAX)
+    {
+        return chunk->size - sizeof(large_hdr) - sizeof(size_t);
+    }
+    return chunk->size - sizeof(size_t);
+}
 
-    ((list_node*)mem_addr)->size = conv_bucket_size(bucket);
+// which lifetime pool a bucket chunk's slab belongs to
+static inline
+int
+chunk_pool(list_node* chunk)
+{
+    segment* seg = (segment*)((uintptr_t)chunk & ~(SEG_SIZE - 1));
+    long unit = ((uintptr_t)chunk & (SEG_SIZE - 1)) / PAGE_SIZE;
+    return (seg->kind[unit] - UNIT_SLAB) / XM_BUCKETS;
+}
 
-    return mem_addr + sizeof(size_t);
+// bytes worth copying when a chunk moves: only large mappings know
+// what was asked for, everything else is copied up to its usable size
+static
+size_t
+chunk_requested(list_node* chunk)
+{
+    if (chunk->size > MID_MAX)
+    {
+        return ((large_hdr*)chunk - 1)->requested;
+    }
+    return chunk->size - sizeof(size_t);
 }
 
+/*
+reservation documentation:
+xmalloc_reserve and $XMALLOC_WARMUP move the first-use costs, mapping a
+segment and faulting in each slab's pages, off the request path. both
+prefault free units in the segments, which every thread's slabs and
+runs are carved from, in the order run_alloc will hand them out.
+xmalloc_reserve then carves the chunks onto the calling thread's free
+list as well. the warm-up runs from a constructor, before main.
+*/
+
+// faults in len bytes at addr without changing what's there
+static
 void
-xfree(void* item)
+populate(void* addr, size_t len)
 {
-    list_node* chunk = (list_node*)(item - sizeof(size_t));
-
-    //if larger than a page
-    if (chunk->size > PAGE_SIZE)
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(addr, len, MADV_POPULATE_WRITE) == 0)
     {
-        int pages = div_up(chunk->size, PAGE_SIZE);
-        //unmap the page divided up
-        int rv = munmap(chunk, chunk->size);
-        if (rv == -1)
-        {
-            perror("unmapping large page");
-        }
+        return;
     }
-    else
+#endif
+    // older kernels: touch every page
+    for (size_t ii = 0; ii < len; ii += 4096)
     {
-        int bucket = conv_size_bucket(chunk->size);
-        chunk->next = heads[bucket];
-        heads[bucket] = chunk;
+        volatile char* pp = (char*)addr + ii;
+        *pp = *pp;
     }
-
 }
 
-void*
-xrealloc(void* prev, size_t bytes)
+// makes sure the next units free units run_alloc hands out are mapped
+// and faulted in. returns how many are ready.
+static
+long
+reserve_units(long units)
 {
-    list_node* chunk = (list_node*)(prev - sizeof(size_t));
-    size_t true_bytes = bytes + sizeof(size_t);
+    long ready = 0;
+    long nfree = 0;
 
-    if (!chunk)
+    XLOCK(&runs_lock, HM_LOCK_OTHER);
+    for (segment* seg = segments; seg; seg = seg->next)
     {
-        return xmalloc(bytes);
+        nfree += seg->nfree;
     }
-    else if (bytes == 0)
+    while (nfree < units)
     {
-        xfree(prev);
-        return 0;
+        segment* seg = new_segment();
+        if (!seg)
+        {
+            break;
+        }
+        nfree += seg->nfree;
     }
-    else if (true_bytes == chunk->size)
+
+    for (segment* seg = segments; seg && ready < units; seg = seg->next)
     {
-        // do nothing
-        return prev;
+        for (long ii = 1; ii < SEG_UNITS && ready < units; ++ii)
+        {
+            if (!bit_get(seg->used, ii))
+            {
+                populate((void*)seg + ii * PAGE_SIZE, PAGE_SIZE);
+                ready += 1;
+            }
+        }
     }
-    else if (true_bytes < chunk->size)
-    {
-        /*
-        // return the difference to the freelist
-        size_t excess_amt = prev_size - true_bytes;
-        void* excess_addr = (void*)prev + true_bytes;
-        list_node* excess = (list_node*)excess_addr;
-        excess->size = excess_amt;
-        excess->next = 0;
-        free_list_insert(excess);
-        */
-
-        // the unreliable xmalloc strikes again
-        // you can't trust what it says
-        // OooOOOOOOOOooooo
+    XUNLOCK(&runs_lock);
 
-        // (this is for speed)
+    return ready;
+}
 
-        // return old pointer
-        return prev;
+// free units needed for count chunks of true_bytes
+static
+long
+units_for(size_t true_bytes, long count)
+{
+    if (true_bytes <= PAGE_SIZE)
+    {
+        // one more for the partly carved slab each thread holds on to
+        return div_up(count, slab_chunks(conv_size_bucket(true_bytes))) + 1;
     }
-    else
+    return count * div_up(true_bytes, PAGE_SIZE);
+}
+
+// $XMALLOC_WARMUP is a list of SIZE:COUNT pairs, like "64:10000,1M:8";
+// sizes take a K or M suffix
+static
+void
+warm_up()
+{
+    const char* spec = getenv("XMALLOC_WARMUP");
+    long units = 0;
+
+    while (spec && *spec)
     {
-        // we need more space than we have
-        void* new_mem = xmalloc(bytes);
-        memcpy(new_mem, prev, (chunk->size - sizeof(size_t)));
-        xfree(prev);
-        return new_mem;
+        char* end;
+        size_t bytes = strtoul(spec, &end, 10);
+        if (*end == 'K' || *end == 'k')
+        {
+            bytes <<= 10;
+            end++;
+        }
+        else if (*end == 'M' || *end == 'm')
+        {
+            bytes <<= 20;
+            end++;
+        }
+        if (*end != ':')
+        {
+            fprintf(stderr, "XMALLOC_WARMUP: expected SIZE:COUNT at \"%s\"\n", spec);
+            break;
+        }
+        long count = strtol(end + 1, &end, 10);
+
+        if (bytes + sizeof(size_t) <= MID_MAX && count > 0)
+        {
+            units += units_for(bytes + sizeof(size_t), count);
+        }
+
+        spec = (*end == ',') ? end + 1 : 0;
+    }
+
+    if (units)
+    {
+        reserve_units(units);
+    }
+}
+
+__attribute__((constructor))
+static
+void
+warm_at_start()
+{
+#ifdef XM_BACKEND
+    // the dispatch build links every backend; only warm up if par is
+    // the one in use
+    if (strcmp(xmalloc_backend(), "par") != 0)
+    {
+        return;
+    }
+#endif
+    warm_up();
+}
+
+/*
+guard documentation:
+with $XMALLOC_GUARD=N, about one xmalloc in N (picked at random) is
+served from the guard pool instead: GUARD_SLOTS one-page slots, each
+with a PROT_NONE page on both sides. the chunk is pushed up against
+the end of its page, so running off the end faults right away, and
+the few bytes of alignment slack are filled in and checked on free.
+xfree makes the page PROT_NONE, so touching it afterwards faults too,
+and freed slots wait in a queue behind every other free slot before
+they're reused. the SIGSEGV handler looks up the slot and prints what
+went wrong with the allocation and free stacks, then lets the fault
+kill us.
+
+the unsampled cost is xm_sample_countdown: a decrement per xmalloc
+(xmalloc_hint and xcalloc too), and a range check per xfree. every
+thread's countdown starts at 0, so its first allocation always goes
+out of line to sampled_malloc, which sets it up: to LONG_MAX when
+sampling is off, or to a random draw when guarding (that first
+allocation is guarded too).
+
+size profile documentation:
+with $XMALLOC_SIZES=FILE every request's true size (header included,
+rounded up to 16) is counted, and the histogram is written to FILE at
+exit. mkclasses turns it into an xclasses.h for -DXM_CLASSES. to see
+every xmalloc the countdown stays at 0 while profiling, which sends the
+inline path in xmalloc.h out of line too, so guard sampling is off.
+*/
+#define GUARD_SLOTS 128
+#define GUARD_DEPTH 16
+#define GUARD_FILL  0xbd
+
+#define GUARD_UNUSED 0
+#define GUARD_LIVE   1
+#define GUARD_FREED  2
+
+typedef struct guard_slot
+{
+    void* user;
+    size_t bytes;
+    int state;
+    int alloc_depth;
+    int free_depth;
+    void* alloc_stack[GUARD_DEPTH];
+    void* free_stack[GUARD_DEPTH];
+} guard_slot;
+
+__thread long xm_sample_countdown = 0;
+static __thread uint64_t guard_rng = 0;
+
+static long guard_rate = 0; // 0 when off
+static char* guard_base = 0;
+static size_t guard_len = 0; // 0 until the pool is set up
+static size_t guard_page;
+static guard_slot guard_slots[GUARD_SLOTS];
+static int guard_queue[GUARD_SLOTS]; // free slots, oldest first
+static int guard_qhead = 0;
+static int guard_qcount = 0;
+static pthread_mutex_t guard_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sigaction guard_prev_action;
+
+#define PROFILE_GRAIN 16
+#define PROFILE_BINS  (65536 / PROFILE_GRAIN + 1) // the last is everything bigger
+
+typedef struct size_hist
+{
+    struct size_hist* next;
+    long counts[PROFILE_BINS];
+} size_hist;
+
+static const char* profile_path = 0;
+static size_hist* profile_hists = 0;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread size_hist* my_hist = 0;
+
+static inline
+int
+is_guarded(void* item)
+{
+    return (uintptr_t)item - (uintptr_t)guard_base < guard_len;
+}
+
+// slot ii's page; pages alternate guard, slot, guard, slot, ..., guard
+static
+char*
+guard_slot_page(int ii)
+{
+    return guard_base + (2 * ii + 1) * guard_page;
+}
+
+static
+long
+guard_next_countdown()
+{
+    if (!guard_rng)
+    {
+        guard_rng = (uintptr_t)&guard_rng ^ xlat_now();
+    }
+    guard_rng ^= guard_rng << 13;
+    guard_rng ^= guard_rng >> 7;
+    guard_rng ^= guard_rng << 17;
+    // uniform on 1 .. 2N - 1, so one in N on average
+    return 1 + guard_rng % (2 * guard_rate - 1);
+}
+
+static
+void
+guard_write(const char* fmt, ...)
+{
+    char buf[256];
+    va_list args;
+    va_start(args, fmt);
+    int nn = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if (nn > (int)sizeof(buf) - 1)
+    {
+        nn = sizeof(buf) - 1;
+    }
+    if (write(2, buf, nn) < 0)
+    {
+        // nowhere left to complain to
+    }
+}
+
+static
+void
+guard_report(const char* what, void* addr, int ii)
+{
+    guard_slot* slot = &(guard_slots[ii]);
+    guard_write("\n== xmalloc guard: %s at %p\n", what, addr);
+    guard_write("chunk %p, %zu bytes, %s\n", slot->user, slot->bytes,
+                slot->state == GUARD_LIVE ? "live" : "freed");
+
+    void* here[GUARD_DEPTH];
+    int depth = backtrace(here, GUARD_DEPTH);
+    guard_write("-- detected at:\n");
+    backtrace_symbols_fd(here, depth, 2);
+    if (slot->alloc_depth)
+    {
+        guard_write("-- allocated at:\n");
+        backtrace_symbols_fd(slot->alloc_stack, slot->alloc_depth, 2);
+    }
+    if (slot->state == GUARD_FREED && slot->free_depth)
+    {
+        guard_write("-- freed at:\n");
+        backtrace_symbols_fd(slot->free_stack, slot->free_depth, 2);
+    }
+}
+
+static
+void
+guard_fault(int sig, siginfo_t* info, void* context)
+{
+    char* addr = info->si_addr;
+    if (!is_guarded(addr))
+    {
+        // not ours; hand it to whoever was there before
+        sigaction(SIGSEGV, &guard_prev_action, 0);
+        return;
+    }
+
+    long page = (addr - guard_base) / guard_page;
+    if (page % 2 == 1)
+    {
+        guard_report("use after free", addr, page / 2);
+    }
+    else
+    {
+        // a guard page: overflow off the slot below, or underflow off
+        // the one above, whichever is live and closer
+        int below = page / 2 - 1;
+        int above = page / 2;
+        int near_below = (addr - guard_base) % guard_page < guard_page / 2;
+        if (above >= GUARD_SLOTS ||
+            (below >= 0 && guard_slots[below].state == GUARD_LIVE &&
+             (near_below || guard_slots[above].state != GUARD_LIVE)))
+        {
+            guard_report("buffer overflow", addr, below);
+        }
+        else
+        {
+            guard_report("buffer underflow", addr, above);
+        }
+    }
+
+    // returning re-runs the access, which now takes the default action
+    signal(SIGSEGV, SIG_DFL);
+}
+
+__attribute__((constructor))
+static
+void
+guard_init()
+{
+    const char* rate = getenv("XMALLOC_GUARD");
+    if (!rate || atol(rate) <= 0)
+    {
+        return;
+    }
+
+    guard_page = sysconf(_SC_PAGESIZE);
+    size_t len = (2 * GUARD_SLOTS + 1) * guard_page;
+    void* base = mmap(0, len, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+    {
+        perror("mapping guard pool");
+        return;
+    }
+
+    for (int ii = 0; ii < GUARD_SLOTS; ++ii)
+    {
+        guard_queue[ii] = ii;
+    }
+    guard_qcount = GUARD_SLOTS;
+
+    // backtrace loads libgcc the first time; get that out of the way
+    void* warm[1];
+    backtrace(warm, 1);
+
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_sigaction = guard_fault;
+    act.sa_flags = SA_SIGINFO;
+    sigemptyset(&act.sa_mask);
+    sigaction(SIGSEGV, &act, &guard_prev_action);
+
+    guard_base = base;
+    guard_len = len;
+    guard_rate = atol(rate);
+}
+
+// the requested bytes plus slack, up to a multiple of 8
+static
+size_t
+guard_rounded(size_t bytes)
+{
+    return bytes ? (bytes + 7) & ~(size_t)7 : 8;
+}
+
+// called when the countdown runs out. returns a guarded chunk, or 0 if
+// this one isn't sampled after all.
+static
+void*
+guard_malloc(size_t bytes)
+{
+    xm_sample_countdown = guard_next_countdown();
+
+    if (bytes + sizeof(size_t) > guard_page)
+    {
+        return 0;
+    }
+
+    XLOCK(&guard_lock, HM_LOCK_MALLOC);
+    if (!guard_qcount)
+    {
+        XUNLOCK(&guard_lock);
+        return 0;
+    }
+    int ii = guard_queue[guard_qhead];
+    guard_qhead = (guard_qhead + 1) % GUARD_SLOTS;
+    guard_qcount -= 1;
+    XUNLOCK(&guard_lock);
+
+    XLAT_SLOW();
+    char* page = guard_slot_page(ii);
+    if (mprotect(page, guard_page, PROT_READ|PROT_WRITE) != 0)
+    {
+        perror("opening guard slot");
+        return 0;
+    }
+
+    // right up against the next guard page, as aligned as any chunk.
+    // even xmalloc(0) gets 8 bytes of slack, or its pointer would be
+    // the guard page itself, which belongs to the next slot.
+    size_t rounded = guard_rounded(bytes);
+    char* user = page + guard_page - rounded;
+    list_node* chunk = (list_node*)(user - sizeof(size_t));
+    chunk->size = rounded + sizeof(size_t);
+    memset(user + bytes, GUARD_FILL, rounded - bytes);
+
+    guard_slot* slot = &(guard_slots[ii]);
+    slot->user = user;
+    slot->bytes = bytes;
+    slot->free_depth = 0;
+    slot->alloc_depth = backtrace(slot->alloc_stack, GUARD_DEPTH);
+    slot->state = GUARD_LIVE;
+    return user;
+}
+
+// a guarded chunk's slack is off limits, so only what was asked for
+// is usable
+static
+size_t
+guard_usable(void* item)
+{
+    return guard_slots[((char*)item - guard_base) / guard_page / 2].bytes;
+}
+
+static
+void
+guard_free(void* item)
+{
+    int ii = ((char*)item - guard_base) / guard_page / 2;
+    guard_slot* slot = &(guard_slots[ii]);
+
+    if (slot->state != GUARD_LIVE || slot->user != item)
+    {
+        guard_report(slot->state == GUARD_FREED ? "double free" : "invalid free",
+                     item, ii);
+        abort();
+    }
+    size_t rounded = guard_rounded(slot->bytes);
+    for (size_t jj = slot->bytes; jj < rounded; ++jj)
+    {
+        if ((unsigned char)((char*)item)[jj] != GUARD_FILL)
+        {
+            guard_report("buffer overflow (found on free)", (char*)item + jj, ii);
+            abort();
+        }
+    }
+
+    slot->free_depth = backtrace(slot->free_stack, GUARD_DEPTH);
+    slot->state = GUARD_FREED;
+    mprotect(guard_slot_page(ii), guard_page, PROT_NONE);
+
+    XLOCK(&guard_lock, HM_LOCK_FREE);
+    guard_queue[(guard_qhead + guard_qcount) % GUARD_SLOTS] = ii;
+    guard_qcount += 1;
+    XUNLOCK(&guard_lock);
+}
+
+static
+void
+profile_write()
+{
+    FILE* out = fopen(profile_path, "w");
+    if (!out)
+    {
+        perror(profile_path);
+        return;
+    }
+
+    long total[PROFILE_BINS] = {0};
+    pthread_mutex_lock(&profile_lock);
+    for (size_hist* hist = profile_hists; hist; hist = hist->next)
+    {
+        for (int ii = 0; ii < PROFILE_BINS; ++ii)
+        {
+            total[ii] += hist->counts[ii];
+        }
+    }
+    pthread_mutex_unlock(&profile_lock);
+
+    fprintf(out, "# xmalloc size profile: true size (header included) and count\n");
+    for (int ii = 0; ii < PROFILE_BINS - 1; ++ii)
+    {
+        if (total[ii])
+        {
+            fprintf(out, "%d %ld\n", (ii + 1) * PROFILE_GRAIN, total[ii]);
+        }
+    }
+    fprintf(out, "# bigger than %d: %ld\n", 65536, total[PROFILE_BINS - 1]);
+    fclose(out);
+}
+
+__attribute__((constructor))
+static
+void
+profile_init()
+{
+    profile_path = getenv("XMALLOC_SIZES");
+    if (profile_path)
+    {
+        atexit(profile_write);
+    }
+}
+
+static
+void
+profile_record(size_t bytes)
+{
+    if (!my_hist)
+    {
+        // from mmap, so recording doesn't show up in the profile
+        my_hist = mmap(0, sizeof(size_hist), PROT_READ|PROT_WRITE,
+                       MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (my_hist == MAP_FAILED)
+        {
+            my_hist = 0;
+            return;
+        }
+        pthread_mutex_lock(&profile_lock);
+        my_hist->next = profile_hists;
+        profile_hists = my_hist;
+        pthread_mutex_unlock(&profile_lock);
+    }
+    size_t true_bytes = bytes + sizeof(size_t);
+    long bin = (true_bytes - 1) / PROFILE_GRAIN;
+    my_hist->counts[bin < PROFILE_BINS - 1 ? bin : PROFILE_BINS - 1] += 1;
+}
+
+// where xmalloc goes when xm_sample_countdown runs out. returns 0 if
+// the chunk should come from the usual place.
+static
+void*
+sampled_malloc(size_t bytes)
+{
+    if (profile_path)
+    {
+        profile_record(bytes);
+        xm_sample_countdown = 0;
+        return 0;
+    }
+    if (guard_rate)
+    {
+        return guard_malloc(bytes);
+    }
+    xm_sample_countdown = LONG_MAX;
+    return 0;
+}
+
+/*
+pressure documentation:
+the footprint is every dirty unit in the segments plus the large
+mappings; clean units are either untouched or purged, and cost nothing
+but address space. segments themselves are never unmapped.
+
+purging flushes the calling thread's lists and every exited thread's
+into the central lists, gives back slabs whose chunks are all there,
+and madvises away every free dirty unit. other threads flush on their
+next refill, and their chunks get purged the next time around.
+*/
+
+static
+size_t
+footprint()
+{
+    return __atomic_load_n(&dirty_units, __ATOMIC_RELAXED) * PAGE_SIZE +
+        __atomic_load_n(&large_mapped, __ATOMIC_RELAXED);
+}
+
+// puts a list on the central list for its pool and bucket
+static
+void
+give_central(list_node* list, int bucket, int pool)
+{
+    if (!list)
+    {
+        return;
+    }
+    list_node* tail = list;
+    while (tail->next)
+    {
+        tail = tail->next;
+    }
+
+    XLOCK(&central_lock, HM_LOCK_OTHER);
+    tail->next = central[pool][bucket];
+    central[pool][bucket] = list;
+    XUNLOCK(&central_lock);
+}
+
+// moves up to CENTRAL_BATCH chunks onto this thread's list; returns
+// one of them for the caller, or 0 if there weren't any
+static
+list_node*
+take_central(int bucket, int pool)
+{
+    XLOCK(&central_lock, HM_LOCK_MALLOC);
+    list_node* first = central[pool][bucket];
+    list_node* last = first;
+    for (int ii = 1; last && last->next && ii < CENTRAL_BATCH; ++ii)
+    {
+        last = last->next;
+    }
+    if (last)
+    {
+        central[pool][bucket] = last->next;
+        last->next = 0;
+    }
+    XUNLOCK(&central_lock);
+
+    if (!first)
+    {
+        return 0;
+    }
+    list_node** heads = pool_heads(pool);
+    heads[bucket] = first->next;
+    return first;
+}
+
+static
+void
+flush_thread()
+{
+    my_flush_gen = __atomic_load_n(&flush_gen, __ATOMIC_RELAXED);
+    for (int pp = 0; pp < POOLS; ++pp)
+    {
+        list_node** heads = pool_heads(pp);
+        for (int bb = 0; bb < XM_BUCKETS; ++bb)
+        {
+            give_central(heads[bb], bb, pp);
+            heads[bb] = 0;
+        }
+    }
+}
+
+// gives whole free units back to the kernel. they stay in the
+// segment, clean, so the next run_alloc knows they're zero again.
+static
+void
+release_units(segment* seg, long start, long count)
+{
+    madvise((void*)seg + start * PAGE_SIZE, count * PAGE_SIZE, MADV_DONTNEED);
+    bits_set(seg->dirty, start, count, 0);
+    dirty_units -= count;
+}
+
+// finds slabs whose chunks are all on the central lists, unlinks the
+// chunks, and frees the slabs. call with central_lock held.
+static
+void
+purge_slabs()
+{
+    XLOCK(&runs_lock, HM_LOCK_OTHER);
+    long nsegs = nsegments;
+    XUNLOCK(&runs_lock);
+
+    size_t tally_bytes = nsegs * SEG_UNITS * sizeof(int) + 1;
+    int* tally = mmap(0, tally_bytes, PROT_READ|PROT_WRITE,
+                      MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if ((long)tally == -1)
+    {
+        return;
+    }
+
+    for (int pp = 0; pp < POOLS; ++pp)
+    {
+        for (int bb = 0; bb < XM_BUCKETS; ++bb)
+        {
+            for (list_node* node = central[pp][bb]; node; node = node->next)
+            {
+                segment* seg = (segment*)((uintptr_t)node & ~(SEG_SIZE - 1));
+                long unit = ((uintptr_t)node & (SEG_SIZE - 1)) / PAGE_SIZE;
+                if (seg->index < nsegs)
+                {
+                    tally[seg->index * SEG_UNITS + unit] += 1;
+                }
+            }
+
+            // unlink the chunks of every slab that's all here
+            long cap = slab_chunks(bb);
+            list_node** link = &(central[pp][bb]);
+            while (*link)
+            {
+                list_node* node = *link;
+                segment* seg = (segment*)((uintptr_t)node & ~(SEG_SIZE - 1));
+                long unit = ((uintptr_t)node & (SEG_SIZE - 1)) / PAGE_SIZE;
+                if (seg->index < nsegs && tally[seg->index * SEG_UNITS + unit] >= cap)
+                {
+                    *link = node->next;
+                }
+                else
+                {
+                    link = &(node->next);
+                }
+            }
+        }
+    }
+
+    XLOCK(&runs_lock, HM_LOCK_FREE);
+    for (segment* seg = segments; seg; seg = seg->next)
+    {
+        if (seg->index >= nsegs)
+        {
+            continue;
+        }
+        for (long uu = 1; uu < SEG_UNITS; ++uu)
+        {
+            int kind = seg->kind[uu];
+            if (kind >= UNIT_SLAB &&
+                tally[seg->index * SEG_UNITS + uu] >= slab_chunks((kind - UNIT_SLAB) % XM_BUCKETS))
+            {
+                bits_set(seg->used, uu, 1, 0);
+                seg->kind[uu] = UNIT_FREE;
+                seg->nfree += 1;
+            }
+        }
+    }
+    XUNLOCK(&runs_lock);
+
+    munmap(tally, tally_bytes);
+}
+
+// madvises away every free unit that's still dirty
+static
+void
+purge_units()
+{
+    XLOCK(&runs_lock, HM_LOCK_FREE);
+    for (segment* seg = segments; seg; seg = seg->next)
+    {
+        long start = -1;
+        for (long uu = 1; uu <= SEG_UNITS; ++uu)
+        {
+            int idle = uu < SEG_UNITS && !bit_get(seg->used, uu) && bit_get(seg->dirty, uu);
+            if (idle && start < 0)
+            {
+                start = uu;
+            }
+            else if (!idle && start >= 0)
+            {
+                release_units(seg, start, uu - start);
+                start = -1;
+            }
+        }
+    }
+    XUNLOCK(&runs_lock);
+}
+
+size_t
+xmalloc_purge()
+{
+    size_t before = footprint();
+
+    flush_thread();
+    __atomic_add_fetch(&flush_gen, 1, __ATOMIC_RELAXED);
+
+    // exited threads' lists are nobody's; take them too
+    pthread_mutex_lock(&refs_lock);
+    for (tcache_ref* ref = refs; ref; ref = ref->next)
+    {
+        if (ref->fresh != ref->orphan_fresh)
+        {
+            continue;
+        }
+        for (int pp = 0; pp < POOLS; ++pp)
+        {
+            for (int bb = 0; bb < XM_BUCKETS; ++bb)
+            {
+                give_central(ref->orphan_heads[pp][bb], bb, pp);
+                ref->orphan_heads[pp][bb] = 0;
+            }
+        }
+    }
+    pthread_mutex_unlock(&refs_lock);
+
+    XLOCK(&central_lock, HM_LOCK_OTHER);
+    purge_slabs();
+    XUNLOCK(&central_lock);
+    purge_units();
+
+    size_t after = footprint();
+    return before > after ? before - after : 0;
+}
+
+size_t
+xmalloc_footprint()
+{
+    return footprint();
+}
+
+void
+xmalloc_flush()
+{
+    // like a purge, minus the purging: just our lists go to central
+    flush_thread();
+}
+
+static
+void
+maybe_relieve()
+{
+    if (xpressure_due(footprint()))
+    {
+        xpressure_relieve(xmalloc_purge, xmalloc_footprint);
+    }
+}
+
+// anything bigger than a bucket. *zeroed is set for fresh memory.
+static
+void*
+big_malloc(size_t size, int* zeroed)
+{
+    void* mem_addr;
+    if (size <= MID_MAX)
+    {
+        mem_addr = mid_malloc(size, zeroed);
+    }
+    else
+    {
+        *zeroed = 1;
+        mem_addr = hmalloc_large(size);
+    }
+    maybe_relieve();
+    return mem_addr;
+}
+
+hm_stats*
+hgetstats()
+{
+    // par only counts what happens on its slow paths: chunk counts
+    // would cost shared writes on every call
+    xlock_collect(&stats);
+    return &stats;
+}
+
+void
+hprintstats()
+{
+    fprintf(stderr, "\n== par malloc stats ==\n");
+    fprintf(stderr, "Mapped:   %ld\n", stats.pages_mapped);
+    fprintf(stderr, "Unmapped: %ld\n", stats.pages_unmapped);
+    xlat_print(stderr);
+    xlock_print(stderr);
+}
+
+// thread exit: park the thread's lists in its ref, where the heap
+// walk can still find them
+static
+void
+orphan_thread(void* arg)
+{
+    tcache_ref* ref = (tcache_ref*)arg;
+
+    pthread_mutex_lock(&refs_lock);
+    for (int pp = 0; pp < POOLS; ++pp)
+    {
+        list_node** heads = pool_heads(pp);
+        for (int ii = 0; ii < XM_BUCKETS; ++ii)
+        {
+            ref->orphan_heads[pp][ii] = heads[ii];
+            ref->orphan_fresh[pp][ii] = fresh[pp][ii];
+            ref->orphan_fresh_end[pp][ii] = fresh_end[pp][ii];
+            heads[ii] = 0;
+            fresh[pp][ii] = fresh_end[pp][ii] = 0;
+        }
+        ref->heads[pp] = ref->orphan_heads[pp];
+    }
+    ref->fresh = ref->orphan_fresh;
+    ref->fresh_end = ref->orphan_fresh_end;
+    pthread_mutex_unlock(&refs_lock);
+}
+
+static
+void
+make_refs_key()
+{
+    pthread_key_create(&refs_key, orphan_thread);
+}
+
+static
+void
+register_thread()
+{
+    // refs come straight from mmap, so registering can't recurse
+    tcache_ref* ref = mmap(0, sizeof(tcache_ref), PROT_READ|PROT_WRITE,
+                           MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if ((long)ref == -1)
+    {
+        perror("registering thread cache");
+        abort();
+    }
+    ref->heads[POOL_SHORT] = xm_heads;
+    ref->heads[POOL_LONG] = long_heads;
+    ref->fresh = fresh;
+    ref->fresh_end = fresh_end;
+
+    pthread_once(&refs_once, make_refs_key);
+    pthread_setspecific(refs_key, ref);
+
+    pthread_mutex_lock(&refs_lock);
+    ref->next = refs;
+    refs = ref;
+    pthread_mutex_unlock(&refs_lock);
+    my_ref = ref;
+}
+
+// per-unit tallies for the heap walk
+typedef struct seg_tally {
+    segment* seg;
+    int free[SEG_UNITS];
+    int uncarved[SEG_UNITS];
+} seg_tally;
+
+static
+seg_tally*
+find_tally(seg_tally* tally, long nn, void* ptr)
+{
+    segment* seg = (segment*)((uintptr_t)ptr & ~(SEG_SIZE - 1));
+    for (long ii = 0; ii < nn; ++ii)
+    {
+        if (tally[ii].seg == seg)
+        {
+            return &(tally[ii]);
+        }
+    }
+    return 0;
+}
+
+static
+int
+log2_bin(long nn)
+{
+    int bin = 63 - __builtin_clzl(nn);
+    return bin < XHEAP_LEN_BINS ? bin : XHEAP_LEN_BINS - 1;
+}
+
+void
+xheap_stats(xheap_info* info)
+{
+    memset(info, 0, sizeof(xheap_info));
+    info->backend = "par";
+    info->slab_size = PAGE_SIZE;
+    for (int ii = 0; ii < XM_BUCKETS; ++ii)
+    {
+        info->classes[ii].size = conv_bucket_size(ii);
+    }
+
+    // segments can't go away, so a snapshot of the list stays valid
+    // after the lock is dropped; runs are counted while it's held
+    pthread_mutex_lock(&runs_lock);
+    long nsegs = nsegments;
+    size_t tally_bytes = nsegs * sizeof(seg_tally) + 1;
+    seg_tally* tally = mmap(0, tally_bytes, PROT_READ|PROT_WRITE,
+                            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if ((long)tally == -1)
+    {
+        pthread_mutex_unlock(&runs_lock);
+        perror("walking heap");
+        return;
+    }
+    long ii = 0;
+    for (segment* seg = segments; seg; seg = seg->next, ++ii)
+    {
+        tally[ii].seg = seg;
+        for (long uu = 0; uu < SEG_UNITS; ++uu)
+        {
+            if (seg->kind[uu] == UNIT_RUN)
+            {
+                list_node* run = (list_node*)((void*)seg + uu * PAGE_SIZE);
+                info->runs += 1;
+                info->run_bytes += run->size;
+            }
+            else if (seg->kind[uu] == UNIT_FREE)
+            {
+                info->run_free_bytes += PAGE_SIZE;
+            }
+        }
+    }
+    info->segments = nsegs;
+    pthread_mutex_unlock(&runs_lock);
+
+    // every thread's free lists and partly carved slabs. a chunk only
+    // counts if it points into a slab of the right class; a list that
+    // runs off into anything else is cut short right there.
+    pthread_mutex_lock(&refs_lock);
+    for (tcache_ref* ref = refs; ref; ref = ref->next)
+    {
+        for (int pp = 0; pp < POOLS; ++pp)
+        {
+            for (int bb = 0; bb < XM_BUCKETS; ++bb)
+            {
+                xheap_class* cls = &(info->classes[bb]);
+                long len = 0;
+                long max_len = nsegs * SEG_UNITS * slab_chunks(bb);
+                for (list_node* node = ref->heads[pp][bb]; node && len < max_len; node = node->next)
+                {
+                    seg_tally* tt = find_tally(tally, nsegs, node);
+                    long unit = ((uintptr_t)node & (SEG_SIZE - 1)) / PAGE_SIZE;
+                    if (!tt || tt->seg->kind[unit] != UNIT_SLAB + XM_BUCKETS * pp + bb)
+                    {
+                        break;
+                    }
+                    tt->free[unit] += 1;
+                    len += 1;
+                }
+                if (len)
+                {
+                    cls->lists += 1;
+                    cls->list_len[log2_bin(len)] += 1;
+                    if (len > cls->list_max)
+                    {
+                        cls->list_max = len;
+                    }
+                }
+
+                void* next = ref->fresh[pp][bb];
+                seg_tally* tt = find_tally(tally, nsegs, next);
+                if (next && next < ref->fresh_end[pp][bb] && tt)
+                {
+                    long unit = ((uintptr_t)next & (SEG_SIZE - 1)) / PAGE_SIZE;
+                    tt->uncarved[unit] = (ref->fresh_end[pp][bb] - next) / cls->size;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&refs_lock);
+
+    // chunks flushed to the central lists
+    XLOCK(&central_lock, HM_LOCK_OTHER);
+    for (int pp = 0; pp < POOLS; ++pp)
+    {
+        for (int bb = 0; bb < XM_BUCKETS; ++bb)
+        {
+            long len = 0;
+            for (list_node* node = central[pp][bb]; node; node = node->next)
+            {
+                seg_tally* tt = find_tally(tally, nsegs, node);
+                if (tt)
+                {
+                    tt->free[((uintptr_t)node & (SEG_SIZE - 1)) / PAGE_SIZE] += 1;
+                }
+                len += 1;
+            }
+            if (len)
+            {
+                xheap_class* cls = &(info->classes[bb]);
+                cls->lists += 1;
+                cls->list_len[log2_bin(len)] += 1;
+                if (len > cls->list_max)
+                {
+                    cls->list_max = len;
+                }
+            }
+        }
+    }
+    XUNLOCK(&central_lock);
+
+    for (ii = 0; ii < nsegs; ++ii)
+    {
+        for (long uu = 0; uu < SEG_UNITS; ++uu)
+        {
+            int kind = tally[ii].seg->kind[uu];
+            if (kind < UNIT_SLAB)
+            {
+                continue;
+            }
+            int bucket = (kind - UNIT_SLAB) % XM_BUCKETS;
+            xheap_class* cls = &(info->classes[bucket]);
+            long cap = slab_chunks(bucket);
+            long nfree = tally[ii].free[uu];
+            long uncarved = tally[ii].uncarved[uu];
+            long live = cap - nfree - uncarved;
+            if (live < 0)
+            {
+                live = 0; // lists changed under us
+            }
+            cls->slabs += 1;
+            cls->free += nfree;
+            cls->uncarved += uncarved;
+            cls->live += live;
+            cls->occupancy[live * 10 / cap] += 1;
+            info->live_bytes += live * (cls->size - sizeof(size_t));
+        }
+    }
+    munmap(tally, tally_bytes);
+
+    pthread_mutex_lock(&large_lock);
+    for (large_hdr* hdr = larges; hdr; hdr = hdr->next)
+    {
+        list_node* chunk = (list_node*)(hdr + 1);
+        if (info->large < XHEAP_MAX_LARGE)
+        {
+            xheap_large* ent = &(info->large_list[info->large]);
+            ent->addr = (void*)chunk + sizeof(size_t);
+            ent->size = chunk->size;
+            ent->requested = hdr->requested;
+        }
+        info->large += 1;
+        info->large_bytes += chunk->size;
+        info->large_requested += hdr->requested;
+    }
+    pthread_mutex_unlock(&large_lock);
+
+    // there's no record of what was asked for below MID_MAX, so live
+    // bytes there are usable bytes
+    info->live_bytes += info->run_bytes - info->runs * sizeof(size_t);
+    info->live_bytes += info->large_requested;
+    info->mapped_bytes = (stats.pages_mapped - stats.pages_unmapped) * (size_t)4096;
+    info->free_bytes = info->mapped_bytes - info->live_bytes
+        - nsegs * PAGE_SIZE; // segment headers
+    info->rss_bytes = xheap_rss();
+}
+
+static
+void*
+do_malloc(size_t bytes, int pool)
+{
+    size_t true_bytes = bytes + sizeof(size_t);
+    int zeroed;
+
+    // handle mid-size and large chunks
+    if (true_bytes > PAGE_SIZE)
+    {
+        return big_malloc(true_bytes, &zeroed);
+    }
+
+    int bucket = conv_size_bucket(true_bytes);
+    list_node* chunk = take_chunk(bucket, pool, &zeroed);
+    if (!chunk)
+    {
+        return 0;
+    }
+    chunk->size = conv_bucket_size(bucket);
+
+    return (void*)chunk + sizeof(size_t);
+}
+
+void*
+xcalloc(size_t nn, size_t bytes)
+{
+    size_t total;
+    if (__builtin_mul_overflow(nn, bytes, &total) ||
+        total > SIZE_MAX - sizeof(size_t))
+    {
+        return 0;
+    }
+
+    size_t true_bytes = total + sizeof(size_t);
+    int zeroed;
+    void* mem_addr = 0;
+    XLAT_START(t0);
+    if (__builtin_expect(--xm_sample_countdown <= 0, 0))
+    {
+        // guard slots are recycled, so never zero
+        mem_addr = sampled_malloc(total);
+        if (mem_addr)
+        {
+            memset(mem_addr, 0, total);
+            XLAT_END(t0, XLAT_MALLOC, total);
+            return mem_addr;
+        }
+    }
+
+    if (true_bytes > PAGE_SIZE)
+    {
+        // a fresh mapping or never-used run is already zero, and its
+        // pages stay unbacked until someone touches them
+        mem_addr = big_malloc(true_bytes, &zeroed);
+        if (mem_addr && !zeroed)
+        {
+            memset(mem_addr, 0, total);
+        }
+    }
+    else
+    {
+        int bucket = conv_size_bucket(true_bytes);
+        list_node* chunk = take_chunk(bucket, POOL_SHORT, &zeroed);
+        if (chunk)
+        {
+            chunk->size = conv_bucket_size(bucket);
+
+            mem_addr = (void*)chunk + sizeof(size_t);
+            if (!zeroed)
+            {
+                memset(mem_addr, 0, chunk->size - sizeof(size_t));
+            }
+        }
+    }
+
+    XLAT_END(t0, XLAT_MALLOC, total);
+    return mem_addr;
+}
+
+static
+void
+do_free(void* item)
+{
+    list_node* chunk = (list_node*)(item - sizeof(size_t));
+
+    if (__builtin_expect(is_guarded(item), 0))
+    {
+        guard_free(item);
+    }
+    else if (chunk->size > PAGE_SIZE && chunk->size <= MID_MAX)
+    {
+        mid_free(chunk);
+    }
+    //if larger than a page
+    else if (chunk->size > PAGE_SIZE)
+    {
+        free_large(chunk);
+    }
+    else
+    {
+        if (__builtin_expect(!my_ref, 0))
+        {
+            register_thread();
+        }
+        int bucket = conv_size_bucket(chunk->size);
+        list_node** heads = pool_heads(chunk_pool(chunk));
+        chunk->next = heads[bucket];
+        heads[bucket] = chunk;
+    }
+}
+
+void*
+(xmalloc)(size_t bytes)
+{
+    XLAT_START(t0);
+    void* mem_addr = 0;
+    if (__builtin_expect(--xm_sample_countdown <= 0, 0))
+    {
+        mem_addr = sampled_malloc(bytes);
+    }
+    if (!mem_addr)
+    {
+        mem_addr = do_malloc(bytes, POOL_SHORT);
+    }
+    XLAT_END(t0, XLAT_MALLOC, bytes);
+    return mem_addr;
+}
+
+long
+xmalloc_reserve(size_t bytes, long count)
+{
+    size_t true_bytes = bytes + sizeof(size_t);
+    if (count <= 0 || true_bytes > MID_MAX)
+    {
+        return 0;
+    }
+
+    if (true_bytes > PAGE_SIZE)
+    {
+        // runs are shared; all we can do is have the units ready
+        long per = div_up(true_bytes, PAGE_SIZE);
+        return reserve_units(count * per) / per;
+    }
+
+    int bucket = conv_size_bucket(true_bytes);
+    reserve_units(units_for(true_bytes, count));
+
+    // carve them now and put them on this thread's list, lowest
+    // address on top
+    list_node* list = 0;
+    for (long ii = 0; ii < count; ++ii)
+    {
+        int zeroed;
+        list_node* chunk = take_chunk(bucket, POOL_SHORT, &zeroed);
+        if (!chunk)
+        {
+            // out of memory: keep what we got
+            count = ii;
+            break;
+        }
+        chunk->size = conv_bucket_size(bucket);
+        chunk->next = list;
+        list = chunk;
+    }
+    while (list)
+    {
+        list_node* next = list->next;
+        list->next = xm_heads[bucket];
+        xm_heads[bucket] = list;
+        list = next;
+    }
+    return count;
+}
+
+void*
+xmalloc_hint(size_t bytes, int hint)
+{
+    XLAT_START(t0);
+    void* mem_addr = 0;
+    if (__builtin_expect(--xm_sample_countdown <= 0, 0))
+    {
+        mem_addr = sampled_malloc(bytes);
+    }
+    if (!mem_addr)
+    {
+        mem_addr = do_malloc(bytes, (hint & XM_LONG_LIVED) ? POOL_LONG : POOL_SHORT);
+    }
+    XLAT_END(t0, XLAT_MALLOC, bytes);
+    return mem_addr;
+}
+
+void
+xfree(void* item)
+{
+    XLAT_START(t0);
+    XLAT_SIZE(size, xmalloc_usable_size(item));
+    do_free(item);
+    XLAT_END(t0, XLAT_FREE, size);
+}
+
+size_t
+xmalloc_usable_size(void* ptr)
+{
+    // every chunk is its whole bucket (or run, or mapping) minus headers
+    if (__builtin_expect(is_guarded(ptr), 0))
+    {
+        return guard_usable(ptr);
+    }
+    return chunk_usable((list_node*)(ptr - sizeof(size_t)));
+}
+
+void*
+xmalloc_at_least(size_t bytes, size_t* actual)
+{
+    void* mem_addr = xmalloc(bytes);
+    *actual = xmalloc_usable_size(mem_addr);
+    return mem_addr;
+}
+
+static
+void*
+do_realloc(void* prev, size_t bytes)
+{
+    list_node* chunk = (list_node*)(prev - sizeof(size_t));
+    size_t true_bytes = bytes + sizeof(size_t);
+
+    if (!prev)
+    {
+        return do_malloc(bytes, POOL_SHORT);
+    }
+    else if (bytes == 0)
+    {
+        do_free(prev);
+        return 0;
+    }
+    else if (bytes <= chunk_usable(chunk) && !is_guarded(prev))
+    {
+        /*
+        // return the difference to the freelist
+        size_t excess_amt = prev_size - true_bytes;
+        void* excess_addr = (void*)prev + true_bytes;
+        list_node* excess = (list_node*)excess_addr;
+        excess->size = excess_amt;
+        excess->next = 0;
+        free_list_insert(excess);
+        */
+
+        // the unreliable xmalloc strikes again
+        // you can't trust what it says
+        // OooOOOOOOOOooooo
+
+        // (this is for speed)
+
+        if (chunk->size > MID_MAX)
+        {
+            ((large_hdr*)chunk - 1)->requested = bytes;
+        }
+
+        // return old pointer
+        return prev;
+    }
+    else if (chunk->size > PAGE_SIZE && true_bytes <= MID_MAX &&
+             mid_grow(chunk, true_bytes))
+    {
+        // grew into the free units right after the run
+        return prev;
+    }
+    else
+    {
+        // we need more space than we have (or it's guarded, and
+        // changing its size would move the slack)
+        XLAT_SLOW();
+        // a moved chunk stays in its lifetime pool
+        int pool = chunk->size <= PAGE_SIZE && !is_guarded(prev) ?
+            chunk_pool(chunk) : POOL_SHORT;
+        void* new_mem = do_malloc(bytes, pool);
+        if (!new_mem)
+        {
+            // out of memory; prev is still good, as with realloc
+            return 0;
+        }
+        size_t keep = chunk_requested(chunk);
+        xcopy(new_mem, prev, keep < bytes ? keep : bytes);
+        do_free(prev);
+        return new_mem;
+    }
+}
+
+void*
+xrealloc(void* prev, size_t bytes)
+{
+    XLAT_START(t0);
+    if (__builtin_expect(profile_path != 0, 0))
+    {
+        profile_record(bytes);
     }
+    void* mem_addr = do_realloc(prev, bytes);
+    XLAT_END(t0, XLAT_REALLOC, bytes);
+    return mem_addr;
 }
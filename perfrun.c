@@ -0,0 +1,341 @@
+
+// Runs a workload under each backend and thread count with hardware
+// performance counters attached, and prints one comparison table.
+//
+//   perfrun [-r REPS] [-b BACKENDS] [-t THREADS] PROGRAM [ARGS...]
+//
+// The program should be one of the *-any binaries: the backend is
+// picked through $XMALLOC_BACKEND. BACKENDS and THREADS are comma
+// separated lists (default sys,hw7,par and 1). A "%t" anywhere in ARGS
+// is replaced by the thread count; without one, THREADS is ignored.
+//
+// Each run gets perf_event_open counters for cycles, instructions,
+// L1d and LLC read misses, dTLB read misses, page faults, and context
+// switches, opened on the child before it execs and inherited by its
+// threads. Hardware events count user space only, so this works with
+// perf_event_paranoid up to 2. Counters the machine doesn't have (say,
+// in a VM) print as "-". Resource usage and peak RSS come from wait4.
+// With -r, every column is the median over the repetitions. The
+// workload's own output goes to /dev/null.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
+
+#define MAX_LIST 16
+#define MAX_REPS 101
+
+typedef struct counter {
+    const char* name;
+    uint32_t type;
+    uint64_t config;
+} counter;
+
+#define CACHE(cache, op, result) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_##op << 8) | (PERF_COUNT_HW_CACHE_RESULT_##result << 16))
+
+static counter counters[] = {
+    { "cycles",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instr",   PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "L1d-miss", PERF_TYPE_HW_CACHE, CACHE(PERF_COUNT_HW_CACHE_L1D, READ, MISS) },
+    { "LLC-miss", PERF_TYPE_HW_CACHE, CACHE(PERF_COUNT_HW_CACHE_LL, READ, MISS) },
+    { "dTLB-miss", PERF_TYPE_HW_CACHE, CACHE(PERF_COUNT_HW_CACHE_DTLB, READ, MISS) },
+    { "faults",  PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+    { "ctxsw",   PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+};
+
+#define NCOUNTERS (sizeof(counters) / sizeof(counters[0]))
+
+// one run's numbers; -1 where a counter couldn't be read
+typedef struct result {
+    double wall_ms;
+    double user_ms;
+    double sys_ms;
+    double maxrss_kb;
+    double minflt;
+    double csw;
+    double counts[NCOUNTERS];
+} result;
+
+#define NFIELDS (sizeof(result) / sizeof(double))
+
+static
+double
+now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static
+int
+split(char* list, char** items)
+{
+    int nn = 0;
+    for (char* tok = strtok(list, ","); tok && nn < MAX_LIST; tok = strtok(0, ",")) {
+        items[nn++] = tok;
+    }
+    return nn;
+}
+
+static
+int
+open_counter(counter* cc, pid_t pid)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = cc->type;
+    attr.config = cc->config;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    // software events (faults, switches) happen in the kernel, so
+    // count them there if we're allowed to; everything else is
+    // user space only
+    if (cc->type == PERF_TYPE_SOFTWARE) {
+        int fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+        if (fd >= 0) {
+            return fd;
+        }
+    }
+    attr.exclude_kernel = 1;
+    return syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+}
+
+// scaled up if the kernel had to multiplex the counter
+static
+double
+read_counter(int fd)
+{
+    uint64_t vals[3];
+    if (fd < 0 || read(fd, vals, sizeof(vals)) != sizeof(vals) || !vals[2]) {
+        return -1;
+    }
+    return (double)vals[0] * vals[1] / vals[2];
+}
+
+static
+void
+run_once(char** argv, const char* backend, result* res)
+{
+    // the child waits on the pipe until its counters are set up
+    int go[2];
+    if (pipe(go) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        close(go[1]);
+        char cc;
+        if (read(go[0], &cc, 1) != 1) {
+            _exit(127);
+        }
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 1);
+        setenv("XMALLOC_BACKEND", backend, 1);
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+
+    close(go[0]);
+    int fds[NCOUNTERS];
+    for (size_t ii = 0; ii < NCOUNTERS; ++ii) {
+        fds[ii] = open_counter(&(counters[ii]), pid);
+    }
+
+    double t0 = now_ms();
+    if (write(go[1], "g", 1) != 1) {
+        perror("starting workload");
+    }
+    close(go[1]);
+
+    int status;
+    struct rusage ru;
+    wait4(pid, &status, 0, &ru);
+    res->wall_ms = now_ms() - t0;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "perfrun: %s (%s) failed\n", argv[0], backend);
+    }
+
+    res->user_ms = ru.ru_utime.tv_sec * 1e3 + ru.ru_utime.tv_usec / 1e3;
+    res->sys_ms = ru.ru_stime.tv_sec * 1e3 + ru.ru_stime.tv_usec / 1e3;
+    res->maxrss_kb = ru.ru_maxrss;
+    res->minflt = ru.ru_minflt + ru.ru_majflt;
+    res->csw = ru.ru_nvcsw + ru.ru_nivcsw;
+    for (size_t ii = 0; ii < NCOUNTERS; ++ii) {
+        res->counts[ii] = read_counter(fds[ii]);
+        if (fds[ii] >= 0) {
+            close(fds[ii]);
+        }
+    }
+}
+
+static
+int
+cmp_double(const void* aa, const void* bb)
+{
+    double xx = *(const double*)aa;
+    double yy = *(const double*)bb;
+    return (xx > yy) - (xx < yy);
+}
+
+static
+void
+median(result* runs, int nn, result* out)
+{
+    double vals[MAX_REPS];
+    for (size_t ff = 0; ff < NFIELDS; ++ff) {
+        for (int ii = 0; ii < nn; ++ii) {
+            vals[ii] = ((double*)&(runs[ii]))[ff];
+        }
+        qsort(vals, nn, sizeof(double), cmp_double);
+        ((double*)out)[ff] = vals[nn / 2];
+    }
+}
+
+// counts get a k/M/G suffix to keep the table narrow
+static
+void
+print_count(double val)
+{
+    if (val < 0) {
+        printf(" %9s", "-");
+    }
+    else if (val >= 1e9) {
+        printf(" %8.2fG", val / 1e9);
+    }
+    else if (val >= 1e6) {
+        printf(" %8.2fM", val / 1e6);
+    }
+    else if (val >= 1e3) {
+        printf(" %8.2fk", val / 1e3);
+    }
+    else {
+        printf(" %9.0f", val);
+    }
+}
+
+static
+void
+print_row(const char* backend, const char* threads, result* res, double base_ms)
+{
+    printf("%-7s %7s %9.1f %6.2f", backend, threads, res->wall_ms,
+           base_ms > 0 ? res->wall_ms / base_ms : 1.0);
+    for (size_t ii = 0; ii < NCOUNTERS; ++ii) {
+        print_count(res->counts[ii]);
+    }
+    double cycles = res->counts[0];
+    double instr = res->counts[1];
+    if (cycles > 0 && instr >= 0) {
+        printf(" %5.2f", instr / cycles);
+    }
+    else {
+        printf(" %5s", "-");
+    }
+    printf(" %8.1f %8.1f", res->user_ms, res->sys_ms);
+    print_count(res->minflt);
+    print_count(res->csw);
+    printf(" %9.0f\n", res->maxrss_kb);
+}
+
+int
+main(int argc, char* argv[])
+{
+    char backend_list[] = "sys,hw7,par";
+    char thread_list[] = "1";
+    char* backends[MAX_LIST];
+    char* threads[MAX_LIST];
+    int nbackends = split(backend_list, backends);
+    int nthreads = split(thread_list, threads);
+    int reps = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "+r:b:t:")) != -1) {
+        switch (opt) {
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        case 'b':
+            nbackends = split(optarg, backends);
+            break;
+        case 't':
+            nthreads = split(optarg, threads);
+            break;
+        default:
+            argc = 0;
+        }
+    }
+    if (argc == 0 || optind >= argc || reps < 1 || reps > MAX_REPS) {
+        printf("Usage:\n");
+        printf("\t%s [-r REPS] [-b sys,hw7,par] [-t 1,2,4] PROGRAM [ARGS...]\n", argv[0]);
+        printf("\t(%%t in ARGS becomes the thread count)\n");
+        return 1;
+    }
+
+    char** args = &(argv[optind]);
+    int nargs = argc - optind;
+    int targ = -1;
+    for (int ii = 0; ii < nargs; ++ii) {
+        if (strcmp(args[ii], "%t") == 0) {
+            targ = ii;
+        }
+    }
+    if (targ < 0) {
+        threads[0] = "-";
+        nthreads = 1;
+    }
+
+    printf("==");
+    for (int ii = 0; ii < nargs; ++ii) {
+        printf(" %s", args[ii]);
+    }
+    printf("  (median of %d)\n", reps);
+    printf("%-7s %7s %9s %6s", "backend", "threads", "wall ms", "rel");
+    for (size_t ii = 0; ii < NCOUNTERS; ++ii) {
+        printf(" %9s", counters[ii].name);
+    }
+    printf(" %5s %8s %8s %9s %9s %9s\n", "IPC", "user ms", "sys ms",
+           "minflt", "csw", "maxrss KB");
+
+    result runs[MAX_REPS];
+    for (int tt = 0; tt < nthreads; ++tt) {
+        if (targ >= 0) {
+            args[targ] = threads[tt];
+        }
+        // "rel" is wall time relative to the first backend
+        double base_ms = 0;
+        for (int bb = 0; bb < nbackends; ++bb) {
+            for (int rr = 0; rr < reps; ++rr) {
+                run_once(args, backends[bb], &(runs[rr]));
+            }
+            result res;
+            median(runs, reps, &res);
+            if (bb == 0) {
+                base_ms = res.wall_ms;
+            }
+            print_row(backends[bb], threads[tt], &res, base_ms);
+        }
+    }
+    return 0;
+}
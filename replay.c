@@ -0,0 +1,392 @@
+
+// Replays an allocation trace recorded by xtrace.c against whichever
+// xmalloc backend this binary was linked with.
+//
+// By default the trace runs on one thread in timestamp order, as fast
+// as possible. With -t every recorded thread gets its own replay thread
+// and the threads take turns so the original interleaving is kept.
+//
+// At the end we report wall time, peak RSS, and fragmentation, which is
+// the peak heap RSS over the peak number of live requested bytes. The
+// peak has to be the replay's own, not the trace loading's, so the
+// kernel's high-water mark is reset after loading (clear_refs) and
+// read back from VmHWM; RSS is also sampled every RSS_EVERY ops, which
+// is all we have where the reset isn't allowed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "xmalloc.h"
+#include "xtrace.h"
+
+typedef struct replay_op {
+    long    id;      // slot for the result, -1 to skip
+    long    old_id;  // slot being freed or realloc'd, -1 if none
+    size_t  size;
+    int     op;
+    int     tid;
+} replay_op;
+
+static replay_op* ops;
+static long nops = 0;
+static long nids = 0;
+static long anomalies = 0;
+
+static void**  slots;
+static size_t* slot_size;
+static size_t  live_bytes = 0;
+static size_t  peak_live = 0;
+
+static long turn = 0; // next op to run in -t mode
+
+#define RSS_EVERY 4096
+static long ops_run = 0;
+static long peak_sampled_kb = 0;
+
+static
+double
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static
+long
+rss_kb()
+{
+    long pages = 0, resident = 0;
+    FILE* fh = fopen("/proc/self/statm", "r");
+    if (fh) {
+        if (fscanf(fh, "%ld %ld", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(fh);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// resets VmHWM to the current RSS; 0 if the kernel won't let us
+static
+int
+reset_peak_rss()
+{
+    FILE* fh = fopen("/proc/self/clear_refs", "w");
+    if (!fh) {
+        return 0;
+    }
+    int ok = fputs("5", fh) >= 0;
+    return fclose(fh) == 0 && ok;
+}
+
+static
+long
+peak_rss_kb()
+{
+    long kb = 0;
+    char line[256];
+    FILE* fh = fopen("/proc/self/status", "r");
+    if (fh) {
+        while (fgets(line, sizeof(line), fh)) {
+            if (sscanf(line, "VmHWM: %ld kB", &kb) == 1) {
+                break;
+            }
+        }
+        fclose(fh);
+    }
+    return kb;
+}
+
+static
+int
+rec_cmp(const void* aa, const void* bb)
+{
+    const xtrace_rec* xx = aa;
+    const xtrace_rec* yy = bb;
+    if (xx->ts != yy->ts) {
+        return xx->ts < yy->ts ? -1 : 1;
+    }
+    // same timestamp: keep file order, which is program order per thread
+    return xx < yy ? -1 : (xx > yy);
+}
+
+// Open addressing map from recorded address to slot id. Used once
+// while loading; the replay itself only indexes arrays.
+
+typedef struct addr_ent {
+    uint64_t addr;
+    long     id;
+} addr_ent;
+
+static addr_ent* amap;
+static size_t amap_cap;
+
+static
+size_t
+amap_find(uint64_t addr)
+{
+    size_t ii = (addr >> 4) * 0x9E3779B97F4A7C15ull & (amap_cap - 1);
+    while (amap[ii].addr && amap[ii].addr != addr) {
+        ii = (ii + 1) & (amap_cap - 1);
+    }
+    return ii;
+}
+
+static
+long
+amap_take(uint64_t addr)
+{
+    size_t ii = amap_find(addr);
+    if (!amap[ii].addr || amap[ii].id < 0) {
+        return -1;
+    }
+    long id = amap[ii].id;
+    amap[ii].id = -1; // tombstone; the address will likely come back
+    return id;
+}
+
+static
+void
+amap_put(uint64_t addr, long id)
+{
+    size_t ii = amap_find(addr);
+    if (amap[ii].addr && amap[ii].id >= 0) {
+        // an address came back before its free was recorded, which
+        // happens when threads race around a realloc; forget the old one
+        anomalies += 1;
+    }
+    amap[ii].addr = addr;
+    amap[ii].id = id;
+}
+
+static
+void
+load_trace(const char* path)
+{
+    FILE* fh = fopen(path, "r");
+    if (!fh) {
+        perror(path);
+        exit(1);
+    }
+
+    fseek(fh, 0, SEEK_END);
+    long nrecs = ftell(fh) / sizeof(xtrace_rec);
+    fseek(fh, 0, SEEK_SET);
+
+    xtrace_rec* recs = malloc(nrecs * sizeof(xtrace_rec));
+    if (fread(recs, sizeof(xtrace_rec), nrecs, fh) != (size_t)nrecs) {
+        perror("reading trace");
+        exit(1);
+    }
+    fclose(fh);
+
+    qsort(recs, nrecs, sizeof(xtrace_rec), rec_cmp);
+
+    amap_cap = 1024;
+    while (amap_cap < 2 * nrecs) {
+        amap_cap *= 2;
+    }
+    amap = calloc(amap_cap, sizeof(addr_ent));
+    ops = malloc(nrecs * sizeof(replay_op));
+
+    for (long ii = 0; ii < nrecs; ++ii) {
+        xtrace_rec* rec = &(recs[ii]);
+        replay_op* op = &(ops[nops]);
+        op->op = rec->op;
+        op->tid = rec->tid;
+        op->size = rec->size;
+        op->id = -1;
+        op->old_id = -1;
+
+        switch (rec->op) {
+        case XTRACE_MALLOC:
+            op->id = nids++;
+            amap_put(rec->ptr, op->id);
+            break;
+        case XTRACE_FREE:
+            op->old_id = amap_take(rec->ptr);
+            if (op->old_id < 0) {
+                anomalies += 1;
+                continue;
+            }
+            break;
+        case XTRACE_REALLOC:
+            if (rec->old) {
+                op->old_id = amap_take(rec->old);
+                if (op->old_id < 0) {
+                    anomalies += 1;
+                }
+            }
+            if (rec->ptr) {
+                op->id = nids++;
+                amap_put(rec->ptr, op->id);
+            }
+            break;
+        default:
+            anomalies += 1;
+            continue;
+        }
+        nops += 1;
+    }
+
+    free(amap);
+    free(recs);
+}
+
+static
+void
+run_op(replay_op* op)
+{
+    void* ptr;
+
+    switch (op->op) {
+    case XTRACE_MALLOC:
+        ptr = xmalloc(op->size);
+        memset(ptr, 0xa5, op->size);
+        slots[op->id] = ptr;
+        slot_size[op->id] = op->size;
+        live_bytes += op->size;
+        break;
+    case XTRACE_FREE:
+        xfree(slots[op->old_id]);
+        live_bytes -= slot_size[op->old_id];
+        break;
+    case XTRACE_REALLOC:
+        if (op->old_id >= 0) {
+            ptr = xrealloc(slots[op->old_id], op->size);
+            live_bytes -= slot_size[op->old_id];
+        }
+        else {
+            ptr = xmalloc(op->size);
+        }
+        if (op->id >= 0) {
+            memset(ptr, 0xa5, op->size);
+            slots[op->id] = ptr;
+            slot_size[op->id] = op->size;
+            live_bytes += op->size;
+        }
+        break;
+    }
+
+    if (live_bytes > peak_live) {
+        peak_live = live_bytes;
+    }
+    if (++ops_run % RSS_EVERY == 0) {
+        long kb = rss_kb();
+        if (kb > peak_sampled_kb) {
+            peak_sampled_kb = kb;
+        }
+    }
+}
+
+static
+void*
+replay_thread(void* arg)
+{
+    long tid = (long)arg;
+
+    for (long ii = 0; ii < nops; ++ii) {
+        if (ops[ii].tid != tid) {
+            continue;
+        }
+        while (__atomic_load_n(&turn, __ATOMIC_ACQUIRE) != ii) {
+            sched_yield();
+        }
+        run_op(&(ops[ii]));
+        __atomic_store_n(&turn, ii + 1, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    int threaded = 0;
+    const char* path = 0;
+
+    for (int ii = 1; ii < argc; ++ii) {
+        if (strcmp(argv[ii], "-t") == 0) {
+            threaded = 1;
+        }
+        else {
+            path = argv[ii];
+        }
+    }
+
+    if (!path) {
+        printf("Usage:\n");
+        printf("\t%s [-t] TRACE\n", argv[0]);
+        return 1;
+    }
+
+    load_trace(path);
+    slots = calloc(nids + 1, sizeof(void*));
+    slot_size = calloc(nids + 1, sizeof(size_t));
+
+    int nthreads = 0;
+    for (long ii = 0; ii < nops; ++ii) {
+        if (ops[ii].tid >= nthreads) {
+            nthreads = ops[ii].tid + 1;
+        }
+    }
+
+    // fault the slot arrays in now, or they'd count as heap
+    memset(slots, 0, (nids + 1) * sizeof(void*));
+    memset(slot_size, 0, (nids + 1) * sizeof(size_t));
+
+    int hwm = reset_peak_rss();
+    long base_kb = rss_kb();
+    peak_sampled_kb = base_kb;
+    double t0 = now();
+
+    if (threaded) {
+        pthread_t* threads = malloc(nthreads * sizeof(pthread_t));
+        for (long ii = 0; ii < nthreads; ++ii) {
+            int rv = pthread_create(&(threads[ii]), 0, replay_thread, (void*)ii);
+            if (rv != 0) {
+                fprintf(stderr, "pthread_create failed\n");
+                return 1;
+            }
+        }
+        for (long ii = 0; ii < nthreads; ++ii) {
+            pthread_join(threads[ii], 0);
+        }
+        free(threads);
+    }
+    else {
+        for (long ii = 0; ii < nops; ++ii) {
+            run_op(&(ops[ii]));
+        }
+    }
+
+    double t1 = now();
+    long peak_kb = rss_kb();
+    if (peak_sampled_kb > peak_kb) {
+        peak_kb = peak_sampled_kb;
+    }
+    if (hwm && peak_rss_kb() > peak_kb) {
+        peak_kb = peak_rss_kb();
+    }
+    long heap_kb = peak_kb - base_kb;
+
+    printf("ops:        %ld (%d threads, %s)\n", nops, nthreads,
+           threaded ? "interleaved" : "max speed");
+    printf("time:       %.6f s\n", t1 - t0);
+    printf("ns/op:      %.1f\n", nops ? (t1 - t0) * 1e9 / nops : 0.0);
+    printf("peak rss:   %ld KiB (%ld KiB above baseline)\n", peak_kb, heap_kb);
+    printf("peak live:  %zu KiB\n", peak_live / 1024);
+    printf("frag:       %.3f\n",
+           peak_live ? (heap_kb * 1024.0) / peak_live : 0.0);
+    if (anomalies) {
+        printf("anomalies:  %ld\n", anomalies);
+    }
+
+    return 0;
+}
@@ -1,26 +1,195 @@
 
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <malloc.h>
 
 #include "xmalloc.h"
+#include "xlat.h"
+#include "xpressure.h"
 
+// never filled; makes the inline path in xmalloc.h miss every time.
+// in the dispatch build par's are the only ones.
+#ifndef XM_BACKEND
+__thread xm_node* xm_heads[XM_BUCKETS];
+__thread long xm_sample_countdown;
+#endif
+
+// mallinfo2 walks every arena, so the soft limit is only checked
+// every so many allocations, or once this thread has asked for so many
+// bytes since the last check. that's every call for requests big
+// enough to get their own mapping.
+#define PRESSURE_EVERY 1024
+#define PRESSURE_BYTES ((size_t)128 << 10) // glibc's default mmap threshold
+
+static __thread int pressure_countdown = PRESSURE_EVERY;
+static __thread size_t pressure_bytes = 0;
+
+static
+void
+maybe_relieve()
+{
+    pressure_countdown = PRESSURE_EVERY;
+    pressure_bytes = 0;
+    if (xpressure_armed() && xpressure_due(xmalloc_footprint())) {
+        xpressure_relieve(xmalloc_purge, xmalloc_footprint);
+    }
+}
+
+static inline
+void
+count_alloc(size_t bytes)
+{
+    pressure_bytes += bytes;
+    if (__builtin_expect(--pressure_countdown == 0 || pressure_bytes >= PRESSURE_BYTES, 0)) {
+        maybe_relieve();
+    }
+}
 
 void*
-xmalloc(size_t bytes)
+(xmalloc)(size_t bytes)
 {
-    return malloc(bytes);
+    XLAT_START(t0);
+    void* ptr = malloc(bytes);
+    count_alloc(bytes);
+    XLAT_END(t0, XLAT_MALLOC, bytes);
+    return ptr;
 }
 
 void
 xfree(void* ptr)
 {
+    XLAT_START(t0);
+    XLAT_SIZE(size, ptr ? malloc_usable_size(ptr) : 0);
     free(ptr);
+    XLAT_END(t0, XLAT_FREE, size);
+}
+
+void*
+xcalloc(size_t nn, size_t bytes)
+{
+    XLAT_START(t0);
+    void* ptr = calloc(nn, bytes);
+    count_alloc(nn * bytes);
+    XLAT_END(t0, XLAT_MALLOC, nn * bytes);
+    return ptr;
+}
+
+size_t
+xmalloc_usable_size(void* ptr)
+{
+    return malloc_usable_size(ptr);
+}
+
+void*
+xmalloc_at_least(size_t bytes, size_t* actual)
+{
+    void* ptr = xmalloc(bytes);
+    *actual = malloc_usable_size(ptr);
+    return ptr;
+}
+
+void*
+xmalloc_hint(size_t bytes, int hint)
+{
+    return xmalloc(bytes);
+}
+
+long
+xmalloc_reserve(size_t bytes, long count)
+{
+    if (count <= 0 || (size_t)count > SIZE_MAX / sizeof(void*)) {
+        return 0;
+    }
+
+    // no way to set chunks aside; allocating and freeing them at least
+    // leaves the memory mapped and faulted in where glibc keeps it
+    void** items = malloc(count * sizeof(void*));
+    if (!items) {
+        return 0;
+    }
+    long got = 0;
+    while (got < count && (items[got] = xmalloc(bytes))) {
+        memset(items[got], 0, bytes);
+        got++;
+    }
+    for (long ii = got - 1; ii >= 0; --ii) {
+        xfree(items[ii]);
+    }
+    free(items);
+    return got;
+}
+
+size_t
+xmalloc_purge()
+{
+    size_t before = xmalloc_footprint();
+    malloc_trim(0);
+    size_t after = xmalloc_footprint();
+    return before > after ? before - after : 0;
+}
+
+size_t
+xmalloc_footprint()
+{
+    struct mallinfo2 mi = mallinfo2();
+    return mi.arena + mi.hblkhd;
+}
+
+void
+xmalloc_flush()
+{
+    // glibc's per-thread cache is a few chunks per size and can't be
+    // flushed from outside; free() already sends chunks to their arena
+}
+
+static hm_stats stats; // glibc keeps its own books
+
+hm_stats*
+hgetstats()
+{
+    xlock_collect(&stats);
+    return &stats;
+}
+
+void
+hprintstats()
+{
+    fprintf(stderr, "\n== sys malloc stats ==\n");
+    malloc_stats();
+    xlat_print(stderr);
+    xlock_print(stderr);
 }
 
 void*
 xrealloc(void* prev, size_t bytes)
 {
-    return realloc(prev, bytes);
+    XLAT_START(t0);
+    void* ptr = realloc(prev, bytes);
+    count_alloc(bytes);
+    XLAT_END(t0, XLAT_REALLOC, bytes);
+    return ptr;
 }
 
+
+// glibc doesn't expose its bins, so only the totals get filled in
+void
+xheap_stats(xheap_info* info)
+{
+    struct mallinfo2 mi = mallinfo2();
+
+    memset(info, 0, sizeof(xheap_info));
+    info->backend = "sys";
+    for (int ii = 0; ii < XM_BUCKETS; ++ii) {
+        info->classes[ii].size = xm_bucket_size(ii);
+    }
+    info->large = mi.hblks;
+    info->large_bytes = mi.hblkhd;
+    info->live_bytes = mi.uordblks + mi.hblkhd;
+    info->free_bytes = mi.fordblks;
+    info->mapped_bytes = mi.arena + mi.hblkhd;
+    info->rss_bytes = xheap_rss();
+}
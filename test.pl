@@ -4,7 +4,7 @@ use warnings FATAL => 'all';
 use POSIX ":sys_wait_h";
 
 use Time::HiRes qw(time);
-use Test::Simple tests => 13;
+use Test::Simple tests => 14;
 
 sub get_time {
     my $data = `cat time.tmp | grep ^real`;
@@ -77,6 +77,9 @@ sub clang_check {
     }
 }
 
+my $defer = `XMALLOC_GUARD=1 ./defer-test-par 2>&1`;
+ok($defer =~ /deferred frees ok/, "deferred frees of guarded chunks");
+
 ok(clang_check(), "clang check");
 
 sub crc_check {
@@ -0,0 +1,34 @@
+#ifndef XBACKEND_H
+#define XBACKEND_H
+
+// Symbol renaming for the dispatch build.
+//
+// The collatz-*-any binaries link all three backends at once behind
+// xdispatch.c. Each backend is compiled a second time with
+// -DXM_BACKEND=sys (or hw7, par), which turns its entry points into
+// sys_xmalloc, sys_xfree, and so on, so they don't collide. Ordinary
+// builds don't define XM_BACKEND and nothing here applies.
+
+#ifdef XM_BACKEND
+
+#define XM_PASTE(bb, fn) bb##_##fn
+#define XM_NAME(bb, fn)  XM_PASTE(bb, fn)
+
+#define xmalloc             XM_NAME(XM_BACKEND, xmalloc)
+#define xfree               XM_NAME(XM_BACKEND, xfree)
+#define xcalloc             XM_NAME(XM_BACKEND, xcalloc)
+#define xrealloc            XM_NAME(XM_BACKEND, xrealloc)
+#define xmalloc_usable_size XM_NAME(XM_BACKEND, xmalloc_usable_size)
+#define xmalloc_at_least    XM_NAME(XM_BACKEND, xmalloc_at_least)
+#define xmalloc_hint        XM_NAME(XM_BACKEND, xmalloc_hint)
+#define xmalloc_reserve     XM_NAME(XM_BACKEND, xmalloc_reserve)
+#define xmalloc_purge       XM_NAME(XM_BACKEND, xmalloc_purge)
+#define xmalloc_footprint   XM_NAME(XM_BACKEND, xmalloc_footprint)
+#define xmalloc_flush       XM_NAME(XM_BACKEND, xmalloc_flush)
+#define xheap_stats         XM_NAME(XM_BACKEND, xheap_stats)
+#define hgetstats           XM_NAME(XM_BACKEND, hgetstats)
+#define hprintstats         XM_NAME(XM_BACKEND, hprintstats)
+
+#endif
+
+#endif
@@ -0,0 +1,273 @@
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "xmalloc.h"
+#include "xcache.h"
+
+// A cache keeps its free constructed objects on an array stack under
+// its lock, and its slabs on a list so xcache_destroy can run every
+// dtor. The stack never needs more room than the cache has objects, so
+// it only grows along with the slabs.
+//
+// In front of that, each thread has a magazine per cache, found by the
+// cache's slot in the registry. A magazine remembers the serial number
+// of the cache it was filled from: when a cache is destroyed and its
+// slot reused, other threads' magazines for the old one are stale and
+// just get emptied. Magazines trade XCACHE_MAG / 2 objects with the
+// cache at a time, so a thread that allocates and frees around a
+// boundary doesn't take the lock every time.
+
+#define XCACHE_MAG      32
+#define XCACHE_SLAB     (16 << 10) // bytes per slab, at least
+#define XCACHE_MIN_OBJS 8          // objects per slab, at least
+
+typedef struct slab {
+    struct slab* next;
+} slab;
+
+struct xcache {
+    size_t size;
+    size_t align;
+    size_t stride;   // size rounded up to align
+    long per_slab;
+    void (*ctor)(void*);
+    void (*dtor)(void*);
+    int id;          // slot in caches[]
+    long serial;
+
+    pthread_mutex_t lock;
+    slab* slabs;
+    long nobjs;      // in all slabs
+    void** free;     // constructed, not in any magazine
+    long nfree;
+};
+
+typedef struct magazine {
+    long serial;     // of the cache these came from
+    long count;
+    void* items[XCACHE_MAG];
+} magazine;
+
+static xcache* caches[XCACHE_MAX];
+static long next_serial = 1;
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread magazine* mags[XCACHE_MAX];
+static pthread_key_t mags_key;
+static pthread_once_t mags_once = PTHREAD_ONCE_INIT;
+
+// hands all but keep of mag's objects back; cache lock held
+static
+void
+give_back(xcache* cache, magazine* mag, long keep)
+{
+    while (mag->count > keep) {
+        cache->free[cache->nfree++] = mag->items[--mag->count];
+    }
+}
+
+// thread exit: everything left in our magazines goes back
+static
+void
+flush_mags(void* arg)
+{
+    for (int ii = 0; ii < XCACHE_MAX; ++ii) {
+        magazine* mag = mags[ii];
+        if (!mag) {
+            continue;
+        }
+        pthread_mutex_lock(&caches_lock);
+        xcache* cache = caches[ii];
+        if (cache && cache->serial == mag->serial) {
+            pthread_mutex_lock(&(cache->lock));
+            give_back(cache, mag, 0);
+            pthread_mutex_unlock(&(cache->lock));
+        }
+        pthread_mutex_unlock(&caches_lock);
+        xfree(mag);
+        mags[ii] = 0;
+    }
+}
+
+static
+void
+make_mags_key()
+{
+    pthread_key_create(&mags_key, flush_mags);
+}
+
+// the calling thread's magazine for cache, emptied if it was left over
+// from a cache that's gone
+static
+magazine*
+get_mag(xcache* cache)
+{
+    magazine* mag = mags[cache->id];
+    if (!mag) {
+        pthread_once(&mags_once, make_mags_key);
+        pthread_setspecific(mags_key, mags);
+        mag = xmalloc(sizeof(magazine));
+        mag->count = 0;
+        mag->serial = cache->serial;
+        mags[cache->id] = mag;
+    }
+    if (mag->serial != cache->serial) {
+        mag->count = 0;
+        mag->serial = cache->serial;
+    }
+    return mag;
+}
+
+// adds a slab's worth of constructed objects; cache lock held
+static
+int
+grow(xcache* cache)
+{
+    void** room = xrealloc(cache->free, (cache->nobjs + cache->per_slab) * sizeof(void*));
+    if (!room) {
+        return 0;
+    }
+    cache->free = room;
+
+    slab* sl = xmalloc(sizeof(slab) + cache->align - 1 + cache->per_slab * cache->stride);
+    if (!sl) {
+        return 0;
+    }
+    sl->next = cache->slabs;
+    cache->slabs = sl;
+
+    uintptr_t first = ((uintptr_t)(sl + 1) + cache->align - 1) & ~(cache->align - 1);
+    for (long ii = 0; ii < cache->per_slab; ++ii) {
+        void* obj = (void*)(first + ii * cache->stride);
+        if (cache->ctor) {
+            cache->ctor(obj);
+        }
+        cache->free[cache->nfree++] = obj;
+    }
+    cache->nobjs += cache->per_slab;
+    return 1;
+}
+
+xcache*
+xcache_create(size_t size, size_t align,
+              void (*ctor)(void* obj), void (*dtor)(void* obj))
+{
+    if (align == 0) {
+        align = sizeof(void*);
+    }
+    if (align & (align - 1)) {
+        return 0;
+    }
+
+    xcache* cache = xmalloc(sizeof(xcache));
+    memset(cache, 0, sizeof(xcache));
+    cache->size = size;
+    cache->align = align;
+    cache->stride = (size + align - 1) & ~(align - 1);
+    if (cache->stride == 0) {
+        cache->stride = align;
+    }
+    cache->per_slab = XCACHE_SLAB / cache->stride;
+    if (cache->per_slab < XCACHE_MIN_OBJS) {
+        cache->per_slab = XCACHE_MIN_OBJS;
+    }
+    cache->ctor = ctor;
+    cache->dtor = dtor;
+    pthread_mutex_init(&(cache->lock), 0);
+
+    pthread_mutex_lock(&caches_lock);
+    cache->id = -1;
+    for (int ii = 0; ii < XCACHE_MAX; ++ii) {
+        if (!caches[ii]) {
+            cache->id = ii;
+            cache->serial = next_serial++;
+            caches[ii] = cache;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&caches_lock);
+
+    if (cache->id < 0) {
+        pthread_mutex_destroy(&(cache->lock));
+        xfree(cache);
+        return 0;
+    }
+    return cache;
+}
+
+void
+xcache_destroy(xcache* cache)
+{
+    pthread_mutex_lock(&caches_lock);
+    caches[cache->id] = 0;
+    pthread_mutex_unlock(&caches_lock);
+
+    if (mags[cache->id] && mags[cache->id]->serial == cache->serial) {
+        mags[cache->id]->count = 0;
+    }
+
+    // every object is free by now, wherever it's sitting, so walking
+    // the slabs reaches each one exactly once
+    uintptr_t mask = ~(cache->align - 1);
+    while (cache->slabs) {
+        slab* sl = cache->slabs;
+        cache->slabs = sl->next;
+        if (cache->dtor) {
+            uintptr_t first = ((uintptr_t)(sl + 1) + cache->align - 1) & mask;
+            for (long ii = 0; ii < cache->per_slab; ++ii) {
+                cache->dtor((void*)(first + ii * cache->stride));
+            }
+        }
+        xfree(sl);
+    }
+
+    xfree(cache->free);
+    pthread_mutex_destroy(&(cache->lock));
+    xfree(cache);
+}
+
+void*
+xcache_alloc(xcache* cache)
+{
+    magazine* mag = mags[cache->id];
+    if (mag && mag->count && mag->serial == cache->serial) {
+        return mag->items[--mag->count];
+    }
+
+    mag = get_mag(cache);
+    pthread_mutex_lock(&(cache->lock));
+    if (!cache->nfree && !grow(cache)) {
+        pthread_mutex_unlock(&(cache->lock));
+        return 0;
+    }
+    while (cache->nfree && mag->count < XCACHE_MAG / 2) {
+        mag->items[mag->count++] = cache->free[--cache->nfree];
+    }
+    pthread_mutex_unlock(&(cache->lock));
+
+    return mag->items[--mag->count];
+}
+
+void
+xcache_free(xcache* cache, void* obj)
+{
+    if (!obj) {
+        return;
+    }
+
+    magazine* mag = mags[cache->id];
+    if (mag && mag->count < XCACHE_MAG && mag->serial == cache->serial) {
+        mag->items[mag->count++] = obj;
+        return;
+    }
+
+    mag = get_mag(cache);
+    if (mag->count == XCACHE_MAG) {
+        pthread_mutex_lock(&(cache->lock));
+        give_back(cache, mag, XCACHE_MAG / 2);
+        pthread_mutex_unlock(&(cache->lock));
+    }
+    mag->items[mag->count++] = obj;
+}
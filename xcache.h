@@ -0,0 +1,37 @@
+#ifndef XCACHE_H
+#define XCACHE_H
+
+#include <stddef.h>
+
+// Object caches for one type of object each, in the style of the
+// kernel's kmem_cache.
+//
+// A cache carves its objects out of its own slabs, allocated from
+// xmalloc, and runs ctor on every object when the slab is made.
+// xcache_free doesn't run dtor: the object goes back to the cache still
+// constructed, so the next xcache_alloc gets it ready to use. Whatever
+// the ctor sets up (an inner buffer, a lock, a list head) is paid for
+// once per object, not once per allocation. Callers have to hand
+// objects back in their constructed state. dtor runs only when the
+// cache is destroyed.
+//
+// Each thread keeps a small magazine of free objects per cache, so
+// alloc and free usually don't take the cache's lock. Slabs are never
+// given back before xcache_destroy.
+//
+// align is a power of two, or 0 for pointer alignment. ctor and dtor
+// may be 0, may call xmalloc, but mustn't use the cache they belong
+// to. At most XCACHE_MAX caches exist at once; xcache_create returns 0
+// past that. Every object has to be freed before xcache_destroy.
+
+#define XCACHE_MAX 64
+
+typedef struct xcache xcache;
+
+xcache* xcache_create(size_t size, size_t align,
+                      void (*ctor)(void* obj), void (*dtor)(void* obj));
+void    xcache_destroy(xcache* cache);
+void*   xcache_alloc(xcache* cache);
+void    xcache_free(xcache* cache, void* obj);
+
+#endif
@@ -0,0 +1,148 @@
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xcopy.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define XCOPY_SMALL 512 // below this, memcpy's setup is cheaper than ours
+
+#define KIND_MEMCPY 0
+#define KIND_SSE2   1
+#define KIND_AVX2   2
+
+static int kind = -1;
+static size_t nt_threshold;
+
+static
+void
+resolve()
+{
+    long llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (llc <= 0) {
+        llc = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    }
+    if (llc <= 0) {
+        llc = 8 << 20;
+    }
+    nt_threshold = llc;
+
+    int kk = KIND_MEMCPY;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kk = KIND_AVX2;
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        kk = KIND_SSE2;
+    }
+#endif
+    __atomic_store_n(&kind, kk, __ATOMIC_RELEASE);
+}
+
+#if defined(__x86_64__)
+
+// both kernels take a dst aligned to their vector size and copy a
+// whole number of 4-vector blocks; xcopy does the ragged ends
+
+__attribute__((target("sse2")))
+static
+void
+copy_sse2(char* dst, const char* src, size_t nn, int stream)
+{
+    for (size_t ii = 0; ii < nn; ii += 64) {
+        __m128i aa = _mm_loadu_si128((const __m128i*)(src + ii));
+        __m128i bb = _mm_loadu_si128((const __m128i*)(src + ii + 16));
+        __m128i cc = _mm_loadu_si128((const __m128i*)(src + ii + 32));
+        __m128i dd = _mm_loadu_si128((const __m128i*)(src + ii + 48));
+        if (stream) {
+            _mm_stream_si128((__m128i*)(dst + ii), aa);
+            _mm_stream_si128((__m128i*)(dst + ii + 16), bb);
+            _mm_stream_si128((__m128i*)(dst + ii + 32), cc);
+            _mm_stream_si128((__m128i*)(dst + ii + 48), dd);
+        }
+        else {
+            _mm_store_si128((__m128i*)(dst + ii), aa);
+            _mm_store_si128((__m128i*)(dst + ii + 16), bb);
+            _mm_store_si128((__m128i*)(dst + ii + 32), cc);
+            _mm_store_si128((__m128i*)(dst + ii + 48), dd);
+        }
+    }
+    if (stream) {
+        _mm_sfence();
+    }
+}
+
+__attribute__((target("avx2")))
+static
+void
+copy_avx2(char* dst, const char* src, size_t nn, int stream)
+{
+    for (size_t ii = 0; ii < nn; ii += 128) {
+        __m256i aa = _mm256_loadu_si256((const __m256i*)(src + ii));
+        __m256i bb = _mm256_loadu_si256((const __m256i*)(src + ii + 32));
+        __m256i cc = _mm256_loadu_si256((const __m256i*)(src + ii + 64));
+        __m256i dd = _mm256_loadu_si256((const __m256i*)(src + ii + 96));
+        if (stream) {
+            _mm256_stream_si256((__m256i*)(dst + ii), aa);
+            _mm256_stream_si256((__m256i*)(dst + ii + 32), bb);
+            _mm256_stream_si256((__m256i*)(dst + ii + 64), cc);
+            _mm256_stream_si256((__m256i*)(dst + ii + 96), dd);
+        }
+        else {
+            _mm256_store_si256((__m256i*)(dst + ii), aa);
+            _mm256_store_si256((__m256i*)(dst + ii + 32), bb);
+            _mm256_store_si256((__m256i*)(dst + ii + 64), cc);
+            _mm256_store_si256((__m256i*)(dst + ii + 96), dd);
+        }
+    }
+    if (stream) {
+        _mm_sfence();
+    }
+}
+
+#endif
+
+void
+xcopy(void* dst, const void* src, size_t bytes)
+{
+    int kk = __atomic_load_n(&kind, __ATOMIC_ACQUIRE);
+    if (__builtin_expect(kk < 0, 0)) {
+        resolve();
+        kk = kind;
+    }
+
+    if (bytes < XCOPY_SMALL || kk == KIND_MEMCPY) {
+        memcpy(dst, src, bytes);
+        return;
+    }
+
+#if defined(__x86_64__)
+    char* dd = dst;
+    const char* ss = src;
+    size_t vec = kk == KIND_AVX2 ? 32 : 16;
+    size_t block = 4 * vec;
+
+    // ragged head, so the kernel's stores are aligned
+    size_t head = (vec - ((uintptr_t)dd & (vec - 1))) & (vec - 1);
+    memcpy(dd, ss, head);
+    dd += head;
+    ss += head;
+    bytes -= head;
+
+    size_t body = bytes & ~(block - 1);
+    int stream = body >= nt_threshold;
+    if (kk == KIND_AVX2) {
+        copy_avx2(dd, ss, body, stream);
+    }
+    else {
+        copy_sse2(dd, ss, body, stream);
+    }
+
+    memcpy(dd + body, ss + body, bytes - body);
+#endif
+}
@@ -0,0 +1,17 @@
+#ifndef XCOPY_H
+#define XCOPY_H
+
+#include <stddef.h>
+
+// Copy engine for xrealloc's move path.
+//
+// Small copies go to memcpy. Bigger ones use AVX2 or SSE2 kernels,
+// picked once from the CPU's features. Copies bigger than the last
+// level cache use non-temporal stores, since the old block is about to
+// be freed and the new one won't all fit in cache anyway; streaming
+// keeps the copy from evicting everything else.
+//
+// The regions mustn't overlap.
+void xcopy(void* dst, const void* src, size_t bytes);
+
+#endif
@@ -0,0 +1,223 @@
+
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "xmalloc.h"
+
+// Deferred frees (see xmalloc.h), built on xfree, so one copy serves
+// every backend.
+//
+// Each thread that defers a free gets a queue: a chain of the freed
+// chunks, linked through their first word, so queuing allocates
+// nothing. Chunks with less than a word usable skip the queue. Only
+// the owner pushes, and a drain takes the whole chain with one
+// exchange, so a push is a compare-and-swap that fails only when a
+// drain got in between, and there's no ABA: the head can't come back
+// to a value the owner read. Queues are never freed. A thread that
+// exits drains its own and leaves it for the next new thread, so the
+// registry only grows and can be walked without a lock.
+
+#define DEFAULT_LIMIT   ((size_t)16 << 20)
+#define DEFAULT_RECLAIM 10 // ms
+
+typedef struct queue {
+    void* head;
+    size_t bytes;  // queued; the owner adds before pushing, drains subtract
+    int owned;
+    struct queue* next;
+} queue;
+
+static queue* queues = 0;
+static pthread_mutex_t queues_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t queue_key;
+static pthread_once_t queue_once = PTHREAD_ONCE_INIT;
+static __thread queue* my_queue = 0;
+
+static size_t limit = DEFAULT_LIMIT;
+
+static int reclaiming = 0;
+static int reclaim_wanted = 0;
+static long reclaim_ms = DEFAULT_RECLAIM;
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaim_cond = PTHREAD_COND_INITIALIZER;
+
+static
+size_t
+drain_queue(queue* qq)
+{
+    void* chain = __atomic_exchange_n(&(qq->head), 0, __ATOMIC_ACQUIRE);
+    size_t bytes = 0;
+    while (chain) {
+        void* next = *(void**)chain;
+        bytes += xmalloc_usable_size(chain);
+        xfree(chain);
+        chain = next;
+    }
+    if (bytes) {
+        __atomic_sub_fetch(&(qq->bytes), bytes, __ATOMIC_RELAXED);
+    }
+    return bytes;
+}
+
+// thread exit: free what's left and let the queue go
+static
+void
+release_queue(void* arg)
+{
+    queue* qq = (queue*)arg;
+    drain_queue(qq);
+    pthread_mutex_lock(&queues_lock);
+    qq->owned = 0;
+    pthread_mutex_unlock(&queues_lock);
+    my_queue = 0;
+}
+
+static
+void
+make_queue_key()
+{
+    pthread_key_create(&queue_key, release_queue);
+}
+
+static
+queue*
+get_queue()
+{
+    pthread_once(&queue_once, make_queue_key);
+
+    pthread_mutex_lock(&queues_lock);
+    queue* qq = queues;
+    while (qq && qq->owned) {
+        qq = qq->next;
+    }
+    if (!qq) {
+        qq = xmalloc(sizeof(queue));
+        memset(qq, 0, sizeof(queue));
+        qq->next = queues;
+        __atomic_store_n(&queues, qq, __ATOMIC_RELEASE);
+    }
+    qq->owned = 1;
+    pthread_mutex_unlock(&queues_lock);
+
+    pthread_setspecific(queue_key, qq);
+    my_queue = qq;
+    return qq;
+}
+
+static
+void
+wake_reclaimer()
+{
+    pthread_mutex_lock(&reclaim_lock);
+    reclaim_wanted = 1;
+    pthread_cond_signal(&reclaim_cond);
+    pthread_mutex_unlock(&reclaim_lock);
+}
+
+void
+xfree_deferred(void* ptr)
+{
+    if (!ptr) {
+        return;
+    }
+
+    // the link goes in the chunk's first word. a chunk too small for
+    // it (par's guarded chunks are exactly what was asked for, with
+    // checked slack or a guard page right after) is freed now.
+    size_t size = xmalloc_usable_size(ptr);
+    if (size < sizeof(void*)) {
+        xfree(ptr);
+        return;
+    }
+
+    queue* qq = my_queue;
+    if (!qq) {
+        qq = get_queue();
+    }
+
+    size_t bytes = __atomic_add_fetch(&(qq->bytes), size, __ATOMIC_RELAXED);
+
+    void* head = __atomic_load_n(&(qq->head), __ATOMIC_RELAXED);
+    do {
+        *(void**)ptr = head;
+    } while (!__atomic_compare_exchange_n(&(qq->head), &head, ptr, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    size_t max = __atomic_load_n(&limit, __ATOMIC_RELAXED);
+    if (bytes > max) {
+        drain_queue(qq);
+    }
+    else if (bytes > max / 2 && bytes - size <= max / 2 &&
+             __atomic_load_n(&reclaiming, __ATOMIC_RELAXED)) {
+        // just went past half: get the reclaimer going before we hit
+        // the limit and have to drain it ourselves
+        wake_reclaimer();
+    }
+}
+
+size_t
+xfree_drain()
+{
+    size_t bytes = 0;
+    queue* qq = __atomic_load_n(&queues, __ATOMIC_ACQUIRE);
+    for (; qq; qq = qq->next) {
+        bytes += drain_queue(qq);
+    }
+    return bytes;
+}
+
+void
+xfree_set_deferred_limit(size_t bytes)
+{
+    __atomic_store_n(&limit, bytes, __ATOMIC_RELAXED);
+}
+
+static
+void*
+reclaim(void* arg)
+{
+    pthread_mutex_lock(&reclaim_lock);
+    while (1) {
+        if (!reclaim_wanted) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += reclaim_ms / 1000;
+            deadline.tv_nsec += (reclaim_ms % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec += 1;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&reclaim_cond, &reclaim_lock, &deadline);
+        }
+        reclaim_wanted = 0;
+        pthread_mutex_unlock(&reclaim_lock);
+
+        if (xfree_drain()) {
+            xmalloc_flush();
+        }
+
+        pthread_mutex_lock(&reclaim_lock);
+    }
+    return 0;
+}
+
+int
+xfree_start_reclaimer(long interval_ms)
+{
+    int rv = 0;
+    pthread_mutex_lock(&reclaim_lock);
+    reclaim_ms = interval_ms > 0 ? interval_ms : DEFAULT_RECLAIM;
+    if (!reclaiming) {
+        pthread_t thread;
+        if (pthread_create(&thread, 0, reclaim, 0) == 0) {
+            pthread_detach(thread);
+            __atomic_store_n(&reclaiming, 1, __ATOMIC_RELAXED);
+        }
+        else {
+            rv = -1;
+        }
+    }
+    pthread_mutex_unlock(&reclaim_lock);
+    return rv;
+}
@@ -0,0 +1,218 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "xmalloc.h"
+
+// One binary, every backend.
+//
+// sys_malloc.c, hw07_malloc.c + hmem.c, and par_malloc.c are compiled
+// again with -DXM_BACKEND=... (see xbackend.h and the Makefile), and
+// the xmalloc.h entry points here pick one per call. The choice is an
+// int in TLS, falling back to a global read from $XMALLOC_BACKEND on
+// first use, and each entry point compares it and makes a direct call,
+// so there's no indirect branch to mispredict.
+//
+// par's thread-local free lists (xm_heads) are also what the inline
+// path in xmalloc.h pops from, so a thread switching off par parks
+// them and gets them back if it switches back.
+
+#define XM_SYS 0
+#define XM_HW7 1
+#define XM_PAR 2
+
+#define DECLARE_BACKEND(bb) \
+    void*  bb##_xmalloc(size_t bytes); \
+    void   bb##_xfree(void* ptr); \
+    void*  bb##_xcalloc(size_t nn, size_t bytes); \
+    void*  bb##_xrealloc(void* prev, size_t bytes); \
+    size_t bb##_xmalloc_usable_size(void* ptr); \
+    void*  bb##_xmalloc_at_least(size_t bytes, size_t* actual); \
+    void*  bb##_xmalloc_hint(size_t bytes, int hint); \
+    long   bb##_xmalloc_reserve(size_t bytes, long count); \
+    size_t bb##_xmalloc_purge(); \
+    size_t bb##_xmalloc_footprint(); \
+    void   bb##_xmalloc_flush(); \
+    void   bb##_xheap_stats(xheap_info* info); \
+    hm_stats* bb##_hgetstats(); \
+    void   bb##_hprintstats();
+
+DECLARE_BACKEND(sys)
+DECLARE_BACKEND(hw7)
+DECLARE_BACKEND(par)
+
+static const char* names[] = { "sys", "hw7", "par" };
+
+static int backend = -1;               // process-wide, once resolved
+static __thread int thread_backend = -1; // per-thread override
+static __thread xm_node* parked_heads[XM_BUCKETS];
+
+static
+int
+parse_backend(const char* name)
+{
+    for (int ii = 0; ii < 3; ++ii) {
+        if (strcmp(name, names[ii]) == 0) {
+            return ii;
+        }
+    }
+    return -1;
+}
+
+static
+int
+resolve_backend()
+{
+    const char* name = getenv("XMALLOC_BACKEND");
+    int bb = name ? parse_backend(name) : -1;
+    if (bb < 0) {
+        bb = XM_PAR;
+    }
+    // every thread that gets here computes the same answer
+    __atomic_store_n(&backend, bb, __ATOMIC_RELAXED);
+    return bb;
+}
+
+static inline
+int
+current()
+{
+    int bb = thread_backend;
+    if (bb < 0) {
+        bb = __atomic_load_n(&backend, __ATOMIC_RELAXED);
+        if (__builtin_expect(bb < 0, 0)) {
+            bb = resolve_backend();
+        }
+    }
+    return bb;
+}
+
+#define DISPATCH(call) \
+    do { \
+        int bb = current(); \
+        if (bb == XM_PAR) { \
+            return par_##call; \
+        } \
+        else if (bb == XM_HW7) { \
+            return hw7_##call; \
+        } \
+        else { \
+            return sys_##call; \
+        } \
+    } while (0)
+
+int
+xmalloc_set_backend(const char* name)
+{
+    int bb = parse_backend(name);
+    if (bb < 0) {
+        return -1;
+    }
+
+    int was = current();
+    if (was == XM_PAR && bb != XM_PAR) {
+        for (int ii = 0; ii < XM_BUCKETS; ++ii) {
+            parked_heads[ii] = xm_heads[ii];
+            xm_heads[ii] = 0;
+        }
+    }
+    else if (was != XM_PAR && bb == XM_PAR) {
+        for (int ii = 0; ii < XM_BUCKETS; ++ii) {
+            xm_heads[ii] = parked_heads[ii];
+            parked_heads[ii] = 0;
+        }
+    }
+
+    thread_backend = bb;
+    return 0;
+}
+
+const char*
+xmalloc_backend()
+{
+    return names[current()];
+}
+
+void*
+(xmalloc)(size_t bytes)
+{
+    DISPATCH(xmalloc(bytes));
+}
+
+void
+xfree(void* ptr)
+{
+    DISPATCH(xfree(ptr));
+}
+
+void*
+xcalloc(size_t nn, size_t bytes)
+{
+    DISPATCH(xcalloc(nn, bytes));
+}
+
+void*
+xrealloc(void* prev, size_t bytes)
+{
+    DISPATCH(xrealloc(prev, bytes));
+}
+
+size_t
+xmalloc_usable_size(void* ptr)
+{
+    DISPATCH(xmalloc_usable_size(ptr));
+}
+
+void*
+xmalloc_at_least(size_t bytes, size_t* actual)
+{
+    DISPATCH(xmalloc_at_least(bytes, actual));
+}
+
+void*
+xmalloc_hint(size_t bytes, int hint)
+{
+    DISPATCH(xmalloc_hint(bytes, hint));
+}
+
+long
+xmalloc_reserve(size_t bytes, long count)
+{
+    DISPATCH(xmalloc_reserve(bytes, count));
+}
+
+size_t
+xmalloc_purge()
+{
+    DISPATCH(xmalloc_purge());
+}
+
+size_t
+xmalloc_footprint()
+{
+    DISPATCH(xmalloc_footprint());
+}
+
+void
+xmalloc_flush()
+{
+    DISPATCH(xmalloc_flush());
+}
+
+void
+xheap_stats(xheap_info* info)
+{
+    DISPATCH(xheap_stats(info));
+}
+
+hm_stats*
+hgetstats()
+{
+    DISPATCH(hgetstats());
+}
+
+void
+hprintstats()
+{
+    DISPATCH(hprintstats());
+}
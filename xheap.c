@@ -0,0 +1,115 @@
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "xmalloc.h"
+
+// Printers for xheap_stats, shared by every backend.
+
+size_t
+xheap_rss()
+{
+    long pages = 0, resident = 0;
+    FILE* fh = fopen("/proc/self/statm", "r");
+    if (fh) {
+        if (fscanf(fh, "%ld %ld", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(fh);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static
+double
+ratio(size_t num, size_t den)
+{
+    return den ? (double)num / den : 0.0;
+}
+
+void
+xheap_report(FILE* out)
+{
+    xheap_info info;
+    xheap_stats(&info);
+
+    fprintf(out, "\n== %s heap ==\n", info.backend);
+    fprintf(out, "%8s %7s %8s %8s %8s %7s %8s  %s\n", "class", "slabs", "live",
+            "free", "uncarved", "lists", "max len", "slab occupancy 0%..100%");
+    for (int ii = 0; ii < XM_BUCKETS; ++ii) {
+        xheap_class* cls = &(info.classes[ii]);
+        if (!cls->slabs && !cls->free) {
+            continue;
+        }
+        fprintf(out, "%8zu %7ld %8ld %8ld %8ld %7ld %8ld ", cls->size, cls->slabs,
+                cls->live, cls->free, cls->uncarved, cls->lists, cls->list_max);
+        for (int bb = 0; bb < XHEAP_OCC_BINS; ++bb) {
+            fprintf(out, " %ld", cls->occupancy[bb]);
+        }
+        fprintf(out, "\n");
+    }
+
+    if (info.segments || info.runs) {
+        fprintf(out, "runs:     %ld in %ld segments, %zu KiB, %zu KiB free\n",
+                info.runs, info.segments, info.run_bytes / 1024,
+                info.run_free_bytes / 1024);
+    }
+    fprintf(out, "large:    %ld mappings, %zu KiB for %zu KiB requested\n",
+            info.large, info.large_bytes / 1024, info.large_requested / 1024);
+    for (long ii = 0; ii < info.large && ii < XHEAP_MAX_LARGE; ++ii) {
+        xheap_large* ent = &(info.large_list[ii]);
+        fprintf(out, "          %p %zu / %zu\n", ent->addr, ent->requested, ent->size);
+    }
+    fprintf(out, "live:     %zu KiB\n", info.live_bytes / 1024);
+    fprintf(out, "free:     %zu KiB\n", info.free_bytes / 1024);
+    fprintf(out, "mapped:   %zu KiB (%.3f of live)\n", info.mapped_bytes / 1024,
+            ratio(info.mapped_bytes, info.live_bytes));
+    fprintf(out, "rss:      %zu KiB (%.3f of live)\n", info.rss_bytes / 1024,
+            ratio(info.rss_bytes, info.live_bytes));
+}
+
+static
+void
+json_longs(FILE* out, const char* key, long* vals, int nn)
+{
+    fprintf(out, "\"%s\": [", key);
+    for (int ii = 0; ii < nn; ++ii) {
+        fprintf(out, "%s%ld", ii ? ", " : "", vals[ii]);
+    }
+    fprintf(out, "]");
+}
+
+void
+xheap_json(FILE* out)
+{
+    xheap_info info;
+    xheap_stats(&info);
+
+    fprintf(out, "{\"backend\": \"%s\", \"slab_size\": %zu,\n", info.backend, info.slab_size);
+    fprintf(out, " \"classes\": [\n");
+    for (int ii = 0; ii < XM_BUCKETS; ++ii) {
+        xheap_class* cls = &(info.classes[ii]);
+        fprintf(out, "  {\"size\": %zu, \"slabs\": %ld, \"live\": %ld, \"free\": %ld, "
+                "\"uncarved\": %ld, \"lists\": %ld, \"list_max\": %ld, ",
+                cls->size, cls->slabs, cls->live, cls->free, cls->uncarved,
+                cls->lists, cls->list_max);
+        json_longs(out, "occupancy", cls->occupancy, XHEAP_OCC_BINS);
+        fprintf(out, ", ");
+        json_longs(out, "list_len_log2", cls->list_len, XHEAP_LEN_BINS);
+        fprintf(out, "}%s\n", ii + 1 < XM_BUCKETS ? "," : "");
+    }
+    fprintf(out, " ],\n");
+    fprintf(out, " \"segments\": %ld, \"runs\": %ld, \"run_bytes\": %zu, \"run_free_bytes\": %zu,\n",
+            info.segments, info.runs, info.run_bytes, info.run_free_bytes);
+    fprintf(out, " \"large\": %ld, \"large_bytes\": %zu, \"large_requested\": %zu,\n",
+            info.large, info.large_bytes, info.large_requested);
+    fprintf(out, " \"large_list\": [");
+    for (long ii = 0; ii < info.large && ii < XHEAP_MAX_LARGE; ++ii) {
+        xheap_large* ent = &(info.large_list[ii]);
+        fprintf(out, "%s\n  {\"addr\": \"%p\", \"size\": %zu, \"requested\": %zu}",
+                ii ? "," : "", ent->addr, ent->size, ent->requested);
+    }
+    fprintf(out, "],\n");
+    fprintf(out, " \"live_bytes\": %zu, \"free_bytes\": %zu, \"mapped_bytes\": %zu, \"rss_bytes\": %zu}\n",
+            info.live_bytes, info.free_bytes, info.mapped_bytes, info.rss_bytes);
+}
@@ -0,0 +1,293 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+#include "hstats.h"
+#include "xlat.h"
+
+// Thread-local latency tables; see xlat.h.
+
+typedef struct xlat_table {
+    struct xlat_table* next;
+    xlat_hist hist;
+} xlat_table;
+
+__thread int xlat_slow_flag = 0;
+
+static __thread xlat_table* my_table = 0;
+static xlat_table* tables = 0; // every thread's table, live or not
+static pthread_mutex_t tables_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char* op_names[XLAT_OPS] = { "xmalloc", "xfree", "xrealloc" };
+
+static pthread_once_t dump_once = PTHREAD_ONCE_INIT;
+
+static
+void
+dump_at_exit()
+{
+    hprintstats();
+}
+
+static
+void
+register_dump()
+{
+    atexit(dump_at_exit);
+}
+
+static
+xlat_table*
+get_table()
+{
+    if (!my_table) {
+        // mmap rather than malloc: the sys backend *is* malloc
+        xlat_table* table = mmap(NULL, sizeof(xlat_table),
+            PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if ((long)table == -1) {
+            perror("mapping latency table");
+            abort();
+        }
+
+        pthread_once(&dump_once, register_dump);
+
+        pthread_mutex_lock(&tables_lock);
+        table->next = tables;
+        tables = table;
+        pthread_mutex_unlock(&tables_lock);
+
+        my_table = table;
+    }
+    return my_table;
+}
+
+void
+xlat_record(int op, int cls, uint64_t ticks)
+{
+    int bin = ticks ? 64 - __builtin_clzl(ticks) : 0;
+    if (bin >= XLAT_BINS) {
+        bin = XLAT_BINS - 1;
+    }
+
+    int slow = xlat_slow_flag;
+    xlat_slow_flag = 0;
+
+    get_table()->hist.counts[op][cls][slow][bin] += 1;
+}
+
+void
+xlat_merge(xlat_hist* into)
+{
+    // other threads may still be counting; a slightly stale
+    // snapshot is fine for a report
+    pthread_mutex_lock(&tables_lock);
+    for (xlat_table* table = tables; table; table = table->next) {
+        long* src = &(table->hist.counts[0][0][0][0]);
+        long* dst = &(into->counts[0][0][0][0]);
+        for (size_t ii = 0; ii < sizeof(xlat_hist) / sizeof(long); ++ii) {
+            dst[ii] += src[ii];
+        }
+    }
+    pthread_mutex_unlock(&tables_lock);
+}
+
+// upper bound of the bin holding the q-th quantile
+static
+uint64_t
+quantile(long* bins, long total, double q)
+{
+    long want = (long)(q * total);
+    long seen = 0;
+    for (int bin = 0; bin < XLAT_BINS; ++bin) {
+        seen += bins[bin];
+        if (seen > want) {
+            return (uint64_t)1 << bin;
+        }
+    }
+    return (uint64_t)1 << (XLAT_BINS - 1);
+}
+
+void
+xlat_print(FILE* out)
+{
+    static xlat_hist hist;
+    memset(&hist, 0, sizeof(hist));
+    xlat_merge(&hist);
+
+    if (!tables) {
+        return;
+    }
+
+    fprintf(out, "\n== latency (ticks, log2 bins) ==\n");
+    fprintf(out, "%-9s %6s %4s %10s %8s %8s %8s %8s %8s\n",
+            "op", "class", "path", "count", "p50", "p90", "p99", "p99.9", "max");
+
+    for (int op = 0; op < XLAT_OPS; ++op) {
+        for (int cls = 0; cls < XLAT_CLASSES; ++cls) {
+            for (int slow = 0; slow < 2; ++slow) {
+                long* bins = hist.counts[op][cls][slow];
+                long total = 0;
+                int top = 0;
+                for (int bin = 0; bin < XLAT_BINS; ++bin) {
+                    total += bins[bin];
+                    if (bins[bin]) {
+                        top = bin;
+                    }
+                }
+                if (!total) {
+                    continue;
+                }
+
+                char cls_name[16];
+                if (cls == XLAT_CLASSES - 1) {
+                    snprintf(cls_name, sizeof(cls_name), "large");
+                }
+                else {
+                    snprintf(cls_name, sizeof(cls_name), "%zu", xm_bucket_size(cls));
+                }
+
+                fprintf(out, "%-9s %6s %4s %10ld %8lu %8lu %8lu %8lu %8lu\n",
+                        op_names[op], cls_name, slow ? "slow" : "fast", total,
+                        quantile(bins, total, 0.5),
+                        quantile(bins, total, 0.9),
+                        quantile(bins, total, 0.99),
+                        quantile(bins, total, 0.999),
+                        (uint64_t)1 << top);
+            }
+        }
+    }
+}
+
+// Lock registry; see xlat.h.
+
+typedef struct xlock_entry {
+    pthread_mutex_t* mutex;
+    uint64_t since; // when the current holder got it
+    int op;         // and what for
+    hm_lockinfo info;
+} xlock_entry;
+
+static xlock_entry xlocks[HM_MAX_LOCKS];
+static long nxlocks = 0;
+static pthread_mutex_t xlocks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char* lock_op_names[HM_LOCK_OPS] = { "malloc", "free", "realloc", "other" };
+
+static
+xlock_entry*
+find_lock(pthread_mutex_t* mutex, const char* name)
+{
+    long nn = __atomic_load_n(&nxlocks, __ATOMIC_ACQUIRE);
+    for (long ii = 0; ii < nn; ++ii) {
+        if (xlocks[ii].mutex == mutex) {
+            return &(xlocks[ii]);
+        }
+    }
+
+    xlock_entry* entry = 0;
+    pthread_mutex_lock(&xlocks_lock);
+    for (long ii = 0; ii < nxlocks; ++ii) {
+        if (xlocks[ii].mutex == mutex) {
+            entry = &(xlocks[ii]);
+        }
+    }
+    if (!entry && nxlocks < HM_MAX_LOCKS) {
+        pthread_once(&dump_once, register_dump);
+        entry = &(xlocks[nxlocks]);
+        entry->mutex = mutex;
+        entry->info.name = name;
+        entry->info.addr = mutex;
+        __atomic_store_n(&nxlocks, nxlocks + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&xlocks_lock);
+    return entry;
+}
+
+void
+xlock_acquire(pthread_mutex_t* mutex, const char* name, int op)
+{
+    uint64_t wait = 0;
+    int contended = 0;
+
+    if (pthread_mutex_trylock(mutex) != 0) {
+        uint64_t t0 = xlat_now();
+        pthread_mutex_lock(mutex);
+        wait = xlat_now() - t0;
+        contended = 1;
+    }
+
+    // we hold the lock, so its entry is ours to update
+    xlock_entry* entry = find_lock(mutex, name);
+    if (!entry) {
+        return; // registry full; lock still works, just isn't counted
+    }
+
+    hm_lockstat* st = &(entry->info.ops[op]);
+    st->acquired += 1;
+    st->contended += contended;
+    st->wait += wait;
+    if ((long)wait > st->wait_max) {
+        st->wait_max = wait;
+    }
+    entry->op = op;
+    entry->since = xlat_now();
+}
+
+void
+xlock_release(pthread_mutex_t* mutex)
+{
+    xlock_entry* entry = find_lock(mutex, 0);
+    if (entry) {
+        long hold = xlat_now() - entry->since;
+        hm_lockstat* st = &(entry->info.ops[entry->op]);
+        st->hold += hold;
+        if (hold > st->hold_max) {
+            st->hold_max = hold;
+        }
+    }
+    pthread_mutex_unlock(mutex);
+}
+
+void
+xlock_collect(hm_stats* stats)
+{
+    long nn = __atomic_load_n(&nxlocks, __ATOMIC_ACQUIRE);
+    stats->nlocks = nn;
+    for (long ii = 0; ii < nn; ++ii) {
+        stats->locks[ii] = xlocks[ii].info;
+    }
+}
+
+void
+xlock_print(FILE* out)
+{
+    long nn = __atomic_load_n(&nxlocks, __ATOMIC_ACQUIRE);
+    if (!nn) {
+        return;
+    }
+
+    fprintf(out, "\n== locks (ticks) ==\n");
+    fprintf(out, "%-22s %-7s %10s %10s %12s %10s %12s %10s\n",
+            "lock", "op", "acquired", "contended", "wait", "wait max",
+            "hold", "hold max");
+
+    for (long ii = 0; ii < nn; ++ii) {
+        hm_lockinfo* info = &(xlocks[ii].info);
+        char name[64];
+        snprintf(name, sizeof(name), "%s@%lx", info->name,
+                 (unsigned long)info->addr & 0xfffff);
+
+        for (int op = 0; op < HM_LOCK_OPS; ++op) {
+            hm_lockstat* st = &(info->ops[op]);
+            if (!st->acquired) {
+                continue;
+            }
+            fprintf(out, "%-22s %-7s %10ld %10ld %12ld %10ld %12ld %10ld\n",
+                    name, lock_op_names[op], st->acquired, st->contended,
+                    st->wait, st->wait_max, st->hold, st->hold_max);
+        }
+    }
+}
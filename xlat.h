@@ -0,0 +1,101 @@
+#ifndef XLAT_H
+#define XLAT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "hstats.h"
+#include "xmalloc.h"
+
+// Per-call latency histograms, compiled in with -DXM_LATENCY.
+//
+// Each backend brackets its entry points with XLAT_START/XLAT_END,
+// and marks its slow paths (new mappings, unmaps, copies) with
+// XLAT_SLOW. XLAT_SIZE captures a size (say, of a chunk about to be
+// freed) only in instrumented builds. Samples land in a thread-local
+// table, bucketed by operation, size class, fast/slow path, and log2
+// of the elapsed ticks. Tables are merged on demand and printed by hprintstats.
+//
+// Without XM_LATENCY all of this compiles away.
+
+#define XLAT_MALLOC  0
+#define XLAT_FREE    1
+#define XLAT_REALLOC 2
+#define XLAT_OPS     3
+
+#define XLAT_CLASSES (XM_BUCKETS + 1) // xmalloc's size classes, then everything larger
+#define XLAT_BINS    40 // log2(ticks)
+
+typedef struct xlat_hist {
+    long counts[XLAT_OPS][XLAT_CLASSES][2][XLAT_BINS];
+} xlat_hist;
+
+// xmalloc.h's size classes (fitted ones too, with -DXM_CLASSES), by
+// requested bytes
+static inline
+int
+xlat_class(size_t bytes)
+{
+    if (bytes > XM_MAX_SMALL - sizeof(size_t)) {
+        return XM_BUCKETS;
+    }
+    return xm_bucket(bytes + sizeof(size_t));
+}
+
+static inline
+uint64_t
+xlat_now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+extern __thread int xlat_slow_flag;
+
+void xlat_record(int op, int cls, uint64_t ticks);
+void xlat_merge(xlat_hist* into);
+void xlat_print(FILE* out);
+
+#ifdef XM_LATENCY
+#define XLAT_START(tt)        uint64_t tt = xlat_now()
+#define XLAT_END(tt, op, sz)  xlat_record((op), xlat_class(sz), xlat_now() - (tt))
+#define XLAT_SLOW()           (xlat_slow_flag = 1)
+#define XLAT_SIZE(var, expr)  size_t var = (expr)
+#else
+#define XLAT_START(tt)
+#define XLAT_END(tt, op, sz)
+#define XLAT_SLOW()
+#define XLAT_SIZE(var, expr)
+#endif
+
+// Lock instrumentation, compiled in with -DXM_LOCKSTAT.
+//
+// Allocator locks are taken with XLOCK(&mutex, op) and released with
+// XUNLOCK(&mutex), where op is one of the HM_LOCK_* in hstats.h. In
+// instrumented builds each lock is registered by address the first
+// time it's used, acquisition tries trylock first so contention can be
+// counted, and wait and hold times are kept per lock and op. The
+// counters are only touched while holding the lock they describe.
+// hgetstats copies them out; hprintstats prints them.
+
+void xlock_acquire(pthread_mutex_t* mutex, const char* name, int op);
+void xlock_release(pthread_mutex_t* mutex);
+void xlock_collect(hm_stats* stats);
+void xlock_print(FILE* out);
+
+#ifdef XM_LOCKSTAT
+#define XLOCK(mm, op) xlock_acquire((mm), #mm, (op))
+#define XUNLOCK(mm)   xlock_release(mm)
+#else
+#define XLOCK(mm, op) pthread_mutex_lock(mm)
+#define XUNLOCK(mm)   pthread_mutex_unlock(mm)
+#endif
+
+#endif
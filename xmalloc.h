@@ -2,19 +2,255 @@
 #define XMALLOC_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
-typedef struct hm_stats {
-    long pages_mapped;
-    long pages_unmapped;
-    long chunks_allocated;
-    long chunks_freed;
-    long free_length;
-} hm_stats;
+#include "hstats.h"
 
-hm_stats* hgetstats();
-void hprintstats();
 void* xmalloc(size_t bytes);
 void  xfree(void* ptr);
+void* xcalloc(size_t nn, size_t bytes);
 void* xrealloc(void* prev, size_t bytes);
 
+// Bytes actually usable at ptr, which is at least what was asked for.
+// xrealloc within that many bytes returns the same pointer.
+size_t xmalloc_usable_size(void* ptr);
+// xmalloc that also reports the usable size in *actual.
+void*  xmalloc_at_least(size_t bytes, size_t* actual);
+
+// Lifetime hints: xmalloc for an object expected to be freed soon
+// (XM_SHORT_LIVED) or to stick around (XM_LONG_LIVED). par carves the
+// two from separate slabs, so long-lived objects don't keep mostly
+// empty slabs of short-lived ones alive; the other backends ignore the
+// hint. Free with xfree as usual.
+#define XM_SHORT_LIVED 1
+#define XM_LONG_LIVED  2
+void*  xmalloc_hint(size_t bytes, int hint);
+
+// Reservation, for paying first-use costs (new mappings, page faults)
+// at startup instead of on the request path. xmalloc_reserve readies
+// count chunks of bytes for the calling thread; in par they're mapped,
+// faulted in, and on the thread's free list, so the next count
+// xmalloc(bytes) calls don't enter the kernel. Returns how many were
+// reserved. Setting $XMALLOC_WARMUP="SIZE:COUNT,..." (sizes may end in
+// K or M) prefaults par's shared pool for the whole process at startup.
+// par can't reserve past its 4 MiB run limit; hw7 and sys only
+// allocate and free, which warms their caches as far as they keep
+// things.
+long   xmalloc_reserve(size_t bytes, long count);
+
+// Memory pressure. xmalloc_footprint is how much memory the allocator
+// is holding on to: dirty slabs and runs plus large mappings in par,
+// hmem's mapped pages in hw7, glibc's arenas in sys. Once it crosses
+// the soft limit set with xmalloc_set_soft_limit (0, the default, means
+// no limit), the allocator purges, as xmalloc_purge does, and then
+// calls every registered callback with the footprint left and the
+// limit, so the application can shed memory of its own. If purging
+// didn't get back under the limit, the next round waits until the
+// footprint has grown by another eighth of it.
+//
+// xmalloc_purge flushes the calling thread's caches and the central
+// ones, and gives whole free slabs and pages back to the kernel. Other
+// threads flush theirs the next time they take a slow path. Returns the
+// bytes released.
+typedef void (*xm_pressure_fn)(size_t footprint, size_t limit, void* arg);
+void   xmalloc_set_soft_limit(size_t bytes);
+int    xmalloc_on_pressure(xm_pressure_fn fn, void* arg); // -1 if full
+size_t xmalloc_purge();
+size_t xmalloc_footprint();
+
+// Deferred frees, for threads that can't afford a free right now (a
+// large munmap, a long list of chunks). xfree_deferred puts ptr on the
+// calling thread's queue with one lock-free push and returns; the chunk
+// is really freed later, in a batch, by xfree_drain or the background
+// reclaimer. A thread's queue holds at most the deferred limit (16 MiB
+// unless set with xfree_set_deferred_limit, 0 frees right away); past
+// that, xfree_deferred drains the caller's queue itself. xfree_drain
+// frees what every thread has queued and returns the bytes freed; call
+// it at a quiet point of your choosing. xfree_start_reclaimer starts a
+// thread that drains every interval_ms, and early when a queue is half
+// full; -1 if it couldn't be started. In the *-any binaries deferred
+// chunks are freed through the drainer's backend.
+//
+// xmalloc_flush gives the calling thread's cached free chunks to the
+// shared lists, where other threads can reuse them. The reclaimer does
+// it after every drain, or what it frees would pile up in its caches.
+void   xfree_deferred(void* ptr);
+size_t xfree_drain();
+void   xfree_set_deferred_limit(size_t bytes);
+int    xfree_start_reclaimer(long interval_ms);
+void   xmalloc_flush();
+
+// Size classes: XM_BUCKETS buckets, sized including the size_t header
+// in front of every chunk. Anything bigger than the last bucket
+// (XM_MAX_SMALL) gets its own mapping. By default the buckets are
+// powers of two, the smallest being 2^XM_MIN_SHIFT bytes. Building with
+// -DXM_CLASSES takes them from xclasses.h instead, a table mkclasses
+// fits to a size profile from par ($XMALLOC_SIZES, see par_malloc.c).
+// Either way the bucket for a constant size folds to a constant.
+#ifdef XM_CLASSES
+#include "xclasses.h"
+#else
+#define XM_BUCKETS   11
+#define XM_MIN_SHIFT 6
+#define XM_MAX_SMALL ((size_t)1 << (XM_MIN_SHIFT + XM_BUCKETS - 1))
+#endif
+
+typedef struct xm_node {
+    size_t size;
+    struct xm_node* next;
+} xm_node;
+
+// Per-thread free lists, one per bucket. par_malloc keeps its freed
+// chunks here; the other backends never fill them, so the inline
+// path below always misses and falls through to them.
+extern __thread xm_node* xm_heads[XM_BUCKETS];
+
+// Allocations left until par samples one, for guard pages
+// ($XMALLOC_GUARD) or the size profile ($XMALLOC_SIZES); see
+// par_malloc.c. Every xmalloc counts it down, the inline path included,
+// and the out-of-line xmalloc samples once it's run out.
+extern __thread long xm_sample_countdown;
+
+#ifdef XM_CLASSES
+
+static const uint32_t xm_class_sizes[XM_BUCKETS] = XM_CLASS_SIZES;
+static const uint8_t xm_class_index[XM_MAX_SMALL / XM_CLASS_GRAIN] = XM_CLASS_INDEX;
+
+// bucket for a chunk of true_bytes (header included), at most XM_MAX_SMALL
+static inline
+int
+xm_bucket(size_t true_bytes)
+{
+    return xm_class_index[(true_bytes - 1) / XM_CLASS_GRAIN];
+}
+
+static inline
+size_t
+xm_bucket_size(int bucket)
+{
+    return xm_class_sizes[bucket];
+}
+
+#else
+
+// bucket for a chunk of true_bytes (header included)
+static inline
+int
+xm_bucket(size_t true_bytes)
+{
+    if (true_bytes <= ((size_t)1 << XM_MIN_SHIFT)) {
+        return 0;
+    }
+    return 64 - __builtin_clzl(true_bytes - 1) - XM_MIN_SHIFT;
+}
+
+static inline
+size_t
+xm_bucket_size(int bucket)
+{
+    return (size_t)1 << (bucket + XM_MIN_SHIFT);
+}
+
+#endif
+
+// Backend selection, only in the *-any binaries (xdispatch.c), which
+// carry all three backends. The backend comes from $XMALLOC_BACKEND
+// (sys, hw7, or par; par if unset), read once on first use.
+// xmalloc_set_backend overrides it for the calling thread and returns
+// -1 for an unknown name. Memory has to be freed through the backend it
+// came from, so switch before a thread allocates anything, and don't
+// hand chunks between threads on different backends.
+int         xmalloc_set_backend(const char* name);
+const char* xmalloc_backend();
+
+// Heap introspection.
+//
+// xheap_stats fills in a snapshot of the heap: per size class, how
+// many slabs there are, how full they are, and how long the free lists
+// are; then the mid-size runs and large mappings. It walks other
+// threads' free lists without stopping them, so the numbers are only
+// exact at a quiescent point (no other thread allocating or freeing);
+// anywhere else they're an estimate. xheap_report prints the same
+// thing for people, xheap_json for scripts.
+//
+// What a backend can't see stays 0; sys only knows mallinfo2 totals.
+
+#define XHEAP_OCC_BINS 11 // slabs by share of live chunks, 0% .. 100% in 10% steps
+#define XHEAP_LEN_BINS 16 // free lists by length, log2
+#define XHEAP_MAX_LARGE 32 // large mappings listed one by one
+
+typedef struct xheap_class {
+    size_t size;     // chunk size, header included
+    long   slabs;
+    long   live;     // chunks handed out
+    long   free;     // chunks on free lists or in caches
+    long   uncarved; // chunks in slabs not handed out yet
+    long   occupancy[XHEAP_OCC_BINS];
+    long   lists;    // non-empty free lists
+    long   list_max;
+    long   list_len[XHEAP_LEN_BINS];
+} xheap_class;
+
+typedef struct xheap_large {
+    void*  addr;
+    size_t size;      // whole mapping
+    size_t requested;
+} xheap_large;
+
+typedef struct xheap_info {
+    const char* backend;
+    size_t      slab_size;
+    xheap_class classes[XM_BUCKETS];
+
+    long   segments;
+    long   runs;           // mid-size runs handed out
+    size_t run_bytes;
+    size_t run_free_bytes; // free units in segments
+
+    long   large;          // dedicated mappings
+    size_t large_bytes;
+    size_t large_requested;
+    xheap_large large_list[XHEAP_MAX_LARGE];
+
+    size_t live_bytes;     // usable bytes handed out
+    size_t free_bytes;     // mapped but not handed out
+    size_t mapped_bytes;
+    size_t rss_bytes;
+} xheap_info;
+
+void   xheap_stats(xheap_info* info);
+void   xheap_report(FILE* out);
+void   xheap_json(FILE* out);
+size_t xheap_rss();
+
+// Inline fast path for constant sizes, like xmalloc(sizeof(cell)).
+// The bucket folds to a constant, so a hit is a TLS load and a pop.
+// Define XM_NO_INLINE to always call out of line; latency builds
+// (XM_LATENCY) do too, so every call gets timed.
+#if defined(__OPTIMIZE__) && !defined(XM_NO_INLINE) && !defined(XM_LATENCY) \
+    && !defined(XM_BACKEND)
+
+static inline __attribute__((always_inline))
+void*
+xm_inline_malloc(size_t bytes)
+{
+    if (bytes + sizeof(size_t) <= XM_MAX_SMALL) {
+        int bucket = xm_bucket(bytes + sizeof(size_t));
+        xm_node* chunk = xm_heads[bucket];
+        if (__builtin_expect(chunk != 0, 1) &&
+            __builtin_expect(--xm_sample_countdown > 0, 1)) {
+            xm_heads[bucket] = chunk->next;
+            chunk->size = xm_bucket_size(bucket);
+            return (char*)chunk + sizeof(size_t);
+        }
+    }
+    return (xmalloc)(bytes);
+}
+
+#define xmalloc(bytes) \
+    (__builtin_constant_p(bytes) ? xm_inline_malloc(bytes) : (xmalloc)(bytes))
+
+#endif
+
 #endif
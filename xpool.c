@@ -0,0 +1,147 @@
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "xmalloc.h"
+#include "xpool.h"
+
+// Pools reserve their whole region PROT_NONE up front and open it up
+// XPOOL_GROW bytes at a time. Never-used slots are bumped off
+// pool->next; freed ones go on a Treiber stack threaded through the
+// slots themselves. The stack head packs a 32-bit handle with a 32-bit
+// tag that every pop bumps, so a slot that's popped and pushed back
+// between someone's load and CAS doesn't fool them.
+
+#define XPOOL_GROW    (256 << 10)
+#define XPOOL_RESERVE ((uint64_t)64 << 30) // default reservation
+
+static
+size_t
+page_round(size_t bytes)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (bytes + page - 1) & ~(page - 1);
+}
+
+static
+size_t
+region_bytes(xpool* pool)
+{
+    return page_round(pool->max * pool->size);
+}
+
+xpool*
+xpool_create(size_t size, uint32_t max)
+{
+    // room for the free link, and 4-byte aligned slots
+    size = size < sizeof(xhandle) ? sizeof(xhandle) : size;
+    size = (size + 3) & ~(size_t)3;
+
+    uint64_t slots = (uint64_t)max + 1;
+    if (!max) {
+        slots = XPOOL_RESERVE / size;
+        if (slots > (uint64_t)UINT32_MAX + 1) {
+            slots = (uint64_t)UINT32_MAX + 1;
+        }
+    }
+
+    xpool* pool = xmalloc(sizeof(xpool));
+    memset(pool, 0, sizeof(xpool));
+    pool->size = size;
+    pool->max = slots;
+    pool->next = 1; // handle 0 is null
+    pthread_mutex_init(&(pool->grow_lock), 0);
+
+    // only address space for now; nothing is committed until it's used
+    void* base = mmap(0, region_bytes(pool), PROT_NONE,
+                      MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        pthread_mutex_destroy(&(pool->grow_lock));
+        xfree(pool);
+        return 0;
+    }
+    pool->base = base;
+    return pool;
+}
+
+void
+xpool_destroy(xpool* pool)
+{
+    munmap(pool->base, region_bytes(pool));
+    pthread_mutex_destroy(&(pool->grow_lock));
+    xfree(pool);
+}
+
+// opens up pages until slot hh is usable
+static
+int
+grow(xpool* pool, uint64_t hh)
+{
+    pthread_mutex_lock(&(pool->grow_lock));
+    uint64_t have = __atomic_load_n(&(pool->committed), __ATOMIC_RELAXED);
+    while (have <= hh) {
+        size_t from = page_round(have * pool->size);
+        size_t to = page_round((hh + 1) * pool->size);
+        if (to - from < XPOOL_GROW) {
+            to = from + XPOOL_GROW;
+        }
+        if (to > region_bytes(pool)) {
+            to = region_bytes(pool);
+        }
+        if (mprotect(pool->base + from, to - from, PROT_READ|PROT_WRITE) != 0) {
+            pthread_mutex_unlock(&(pool->grow_lock));
+            return 0;
+        }
+        have = to / pool->size;
+        if (have > pool->max) {
+            have = pool->max;
+        }
+        __atomic_store_n(&(pool->committed), have, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&(pool->grow_lock));
+    return 1;
+}
+
+xhandle
+xpool_alloc(xpool* pool)
+{
+    uint64_t top = __atomic_load_n(&(pool->free_top), __ATOMIC_ACQUIRE);
+    while ((xhandle)top) {
+        // the slot may be handed out under us; its link is then junk,
+        // but the slot stays mapped and the tag makes the CAS fail
+        xhandle next = *(xhandle*)xpool_ptr(pool, (xhandle)top);
+        uint64_t want = ((top >> 32) + 1) << 32 | next;
+        if (__atomic_compare_exchange_n(&(pool->free_top), &top, want, 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            return (xhandle)top;
+        }
+    }
+
+    uint64_t hh = __atomic_fetch_add(&(pool->next), 1, __ATOMIC_RELAXED);
+    if (hh >= pool->max) {
+        return 0;
+    }
+    if (hh >= __atomic_load_n(&(pool->committed), __ATOMIC_ACQUIRE) && !grow(pool, hh)) {
+        return 0;
+    }
+    return (xhandle)hh;
+}
+
+void
+xpool_free(xpool* pool, xhandle hh)
+{
+    if (!hh) {
+        return;
+    }
+
+    xhandle* link = xpool_ptr(pool, hh);
+    uint64_t top = __atomic_load_n(&(pool->free_top), __ATOMIC_RELAXED);
+    uint64_t want;
+    do {
+        *link = (xhandle)top;
+        want = (top & ~(uint64_t)UINT32_MAX) | hh;
+    } while (!__atomic_compare_exchange_n(&(pool->free_top), &top, want, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
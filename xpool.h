@@ -0,0 +1,62 @@
+#ifndef XPOOL_H
+#define XPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Fixed-size object pools addressed by 32-bit handles.
+//
+// A pool hands out slots of one size from a single contiguous region.
+// A handle is the slot's index into that region, so a linked structure
+// can store 4-byte links instead of 8-byte pointers, and its nodes
+// aren't rounded up to an allocator size class. A list cell holding a
+// long and a link fits a 16-byte slot instead of a 64-byte par chunk.
+//
+// The whole region is reserved when the pool is created, and pages are
+// made usable as the pool grows, so slots never move and translating a
+// handle is one multiply and add. Handle 0 is never handed out; use it
+// as null. Slots are aligned to the largest power of two dividing the
+// slot size, so round the size up to 8 if the nodes hold pointers or
+// longs.
+//
+// xpool_alloc and xpool_free are safe to call from any thread. Freed
+// slots go on a lock-free stack; only growing the region takes a lock.
+
+typedef uint32_t xhandle;
+
+typedef struct xpool {
+    char*    base;      // slot h is at base + h * size
+    size_t   size;
+    uint64_t free_top;  // ABA tag << 32 | handle of the first free slot
+    uint64_t next;      // next never-used slot
+    uint64_t committed; // slots backed by usable pages
+    uint64_t max;       // slots reserved
+    pthread_mutex_t grow_lock;
+} xpool;
+
+// Reserves room for max slots of size bytes. If max is 0, reserves as
+// many as 32-bit handles can reach, up to 64 GiB of address space.
+// Returns 0 if the reservation fails.
+xpool*  xpool_create(size_t size, uint32_t max);
+void    xpool_destroy(xpool* pool);
+
+// Returns 0 when the pool is full.
+xhandle xpool_alloc(xpool* pool);
+void    xpool_free(xpool* pool, xhandle hh);
+
+static inline
+void*
+xpool_ptr(xpool* pool, xhandle hh)
+{
+    return pool->base + (size_t)hh * pool->size;
+}
+
+static inline
+xhandle
+xpool_handle(xpool* pool, void* ptr)
+{
+    return ptr ? (xhandle)(((char*)ptr - pool->base) / pool->size) : 0;
+}
+
+#endif
@@ -0,0 +1,86 @@
+
+#include <pthread.h>
+
+#include "xmalloc.h"
+#include "xpressure.h"
+
+#define MAX_CALLBACKS 16
+
+typedef struct callback {
+    xm_pressure_fn fn;
+    void* arg;
+} callback;
+
+static size_t soft_limit = 0;
+static size_t next_purge = 0; // footprint that sets off the next purge; 0 for never
+static int relieving = 0;
+
+static callback callbacks[MAX_CALLBACKS];
+static int ncallbacks = 0;
+static pthread_mutex_t callbacks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void
+xmalloc_set_soft_limit(size_t bytes)
+{
+    __atomic_store_n(&soft_limit, bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&next_purge, bytes, __ATOMIC_RELAXED);
+}
+
+int
+xmalloc_on_pressure(xm_pressure_fn fn, void* arg)
+{
+    int rv = -1;
+    pthread_mutex_lock(&callbacks_lock);
+    if (ncallbacks < MAX_CALLBACKS) {
+        callbacks[ncallbacks].fn = fn;
+        callbacks[ncallbacks].arg = arg;
+        ncallbacks += 1;
+        rv = 0;
+    }
+    pthread_mutex_unlock(&callbacks_lock);
+    return rv;
+}
+
+int
+xpressure_armed()
+{
+    return __atomic_load_n(&next_purge, __ATOMIC_RELAXED) != 0;
+}
+
+int
+xpressure_due(size_t footprint)
+{
+    size_t next = __atomic_load_n(&next_purge, __ATOMIC_RELAXED);
+    return next && footprint > next;
+}
+
+void
+xpressure_relieve(size_t (*purge)(), size_t (*footprint)())
+{
+    // one thread purges; the rest carry on allocating
+    if (__atomic_exchange_n(&relieving, 1, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    size_t limit = __atomic_load_n(&soft_limit, __ATOMIC_RELAXED);
+    purge();
+    size_t now = footprint();
+
+    // still over after purging: don't purge again until we've grown
+    // another eighth of the limit, or every slow path would purge
+    size_t next = now > limit ? now + limit / 8 : limit;
+    if (limit) {
+        __atomic_store_n(&next_purge, next, __ATOMIC_RELAXED);
+    }
+
+    // callbacks may free memory, so they run without the lock held;
+    // the array only ever grows
+    pthread_mutex_lock(&callbacks_lock);
+    int nn = ncallbacks;
+    pthread_mutex_unlock(&callbacks_lock);
+    for (int ii = 0; ii < nn; ++ii) {
+        callbacks[ii].fn(now, limit, callbacks[ii].arg);
+    }
+
+    __atomic_store_n(&relieving, 0, __ATOMIC_RELEASE);
+}
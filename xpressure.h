@@ -0,0 +1,20 @@
+#ifndef XPRESSURE_H
+#define XPRESSURE_H
+
+#include <stddef.h>
+
+// Soft limit bookkeeping, shared by the backends.
+//
+// xmalloc_set_soft_limit and xmalloc_on_pressure (xmalloc.h) live in
+// xpressure.c, so one registry serves every backend in the dispatch
+// build. Each backend measures its own footprint on its slow paths and
+// calls xpressure_due with it. If that says the limit's been crossed,
+// the backend calls xpressure_relieve with its own purge and footprint
+// functions. xpressure_relieve purges, notifies the callbacks, and
+// decides when the next purge is due.
+
+int  xpressure_armed(); // is there a limit at all
+int  xpressure_due(size_t footprint);
+void xpressure_relieve(size_t (*purge)(), size_t (*footprint)());
+
+#endif
@@ -0,0 +1,197 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "xmalloc.h"
+#include "xtrace.h"
+
+// Trace recorder for the xmalloc.h API.
+//
+// This is linked in with -Wl,--wrap=xmalloc,--wrap=xfree,... (see Makefile)
+// so every call from the program goes through the __wrap_ functions
+// below before reaching whichever backend it was linked against.
+// Calls a backend makes to itself (xrealloc -> xmalloc) aren't wrapped,
+// which is what we want: only the program's view gets recorded.
+//
+// The output file is $XMALLOC_TRACE, or "xmalloc.trace" if unset.
+
+void* __real_xmalloc(size_t bytes);
+void  __real_xfree(void* ptr);
+void* __real_xrealloc(void* prev, size_t bytes);
+void* __real_xcalloc(size_t nn, size_t bytes);
+void* __real_xmalloc_at_least(size_t bytes, size_t* actual);
+void* __real_xmalloc_hint(size_t bytes, int hint);
+
+#define TRACE_BUF 4096 // records per thread buffer
+
+typedef struct trace_buf {
+    struct trace_buf* next;
+    long count;
+    xtrace_rec recs[TRACE_BUF];
+} trace_buf;
+
+static int trace_fd = -1;
+static uint64_t trace_t0;
+static uint16_t next_tid = 0;
+static trace_buf* bufs = 0; // every thread's buffer, for the final flush
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+
+static __thread trace_buf* my_buf = 0;
+static __thread uint16_t my_tid;
+
+static
+uint64_t
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static
+void
+flush_buf(trace_buf* buf)
+{
+    // one write per buffer; O_APPEND keeps buffers from different
+    // threads from overwriting each other
+    size_t len = buf->count * sizeof(xtrace_rec);
+    if (len && write(trace_fd, buf->recs, len) != (ssize_t)len) {
+        perror("writing trace");
+    }
+    buf->count = 0;
+}
+
+static
+void
+flush_all()
+{
+    pthread_mutex_lock(&trace_lock);
+    for (trace_buf* buf = bufs; buf; buf = buf->next) {
+        flush_buf(buf);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static
+void
+trace_init()
+{
+    const char* path = getenv("XMALLOC_TRACE");
+    if (!path) {
+        path = "xmalloc.trace";
+    }
+
+    trace_fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0644);
+    if (trace_fd == -1) {
+        perror("opening trace");
+        exit(1);
+    }
+
+    trace_t0 = now_ns();
+    atexit(flush_all);
+}
+
+static
+trace_buf*
+get_buf()
+{
+    if (!my_buf) {
+        pthread_once(&trace_once, trace_init);
+
+        // the buffer itself comes from the real backend so the
+        // recorder doesn't drag in a second allocator
+        trace_buf* buf = __real_xmalloc(sizeof(trace_buf));
+        buf->count = 0;
+
+        pthread_mutex_lock(&trace_lock);
+        my_tid = next_tid++;
+        buf->next = bufs;
+        bufs = buf;
+        pthread_mutex_unlock(&trace_lock);
+
+        my_buf = buf;
+    }
+    return my_buf;
+}
+
+static
+void
+record(int op, void* ptr, void* old, size_t size, uint64_t ts)
+{
+    trace_buf* buf = get_buf();
+
+    xtrace_rec* rec = &(buf->recs[buf->count]);
+    rec->ts   = ts - trace_t0;
+    rec->ptr  = (uint64_t)ptr;
+    rec->old  = (uint64_t)old;
+    rec->size = size > UINT32_MAX ? UINT32_MAX : size;
+    rec->tid  = my_tid;
+    rec->op   = op;
+    rec->pad  = 0;
+
+    if (++buf->count == TRACE_BUF) {
+        pthread_mutex_lock(&trace_lock);
+        flush_buf(buf);
+        pthread_mutex_unlock(&trace_lock);
+    }
+}
+
+void*
+__wrap_xmalloc(size_t bytes)
+{
+    get_buf();
+    void* ptr = __real_xmalloc(bytes);
+    record(XTRACE_MALLOC, ptr, 0, bytes, now_ns());
+    return ptr;
+}
+
+void
+__wrap_xfree(void* ptr)
+{
+    record(XTRACE_FREE, ptr, 0, 0, now_ns());
+    __real_xfree(ptr);
+}
+
+void*
+__wrap_xrealloc(void* prev, size_t bytes)
+{
+    get_buf();
+    void* ptr = __real_xrealloc(prev, bytes);
+    record(XTRACE_REALLOC, ptr, prev, bytes, now_ns());
+    return ptr;
+}
+
+void*
+__wrap_xcalloc(size_t nn, size_t bytes)
+{
+    // replayed as a plain xmalloc; replay writes every byte anyway
+    get_buf();
+    void* ptr = __real_xcalloc(nn, bytes);
+    record(XTRACE_MALLOC, ptr, 0, nn * bytes, now_ns());
+    return ptr;
+}
+
+void*
+__wrap_xmalloc_at_least(size_t bytes, size_t* actual)
+{
+    get_buf();
+    void* ptr = __real_xmalloc_at_least(bytes, actual);
+    record(XTRACE_MALLOC, ptr, 0, bytes, now_ns());
+    return ptr;
+}
+
+void*
+__wrap_xmalloc_hint(size_t bytes, int hint)
+{
+    // the hint isn't recorded; replay allocates without one
+    get_buf();
+    void* ptr = __real_xmalloc_hint(bytes, hint);
+    record(XTRACE_MALLOC, ptr, 0, bytes, now_ns());
+    return ptr;
+}
@@ -0,0 +1,30 @@
+#ifndef XTRACE_H
+#define XTRACE_H
+
+#include <stdint.h>
+
+// Allocation trace format.
+//
+// A trace file is a flat array of xtrace_rec written by xtrace.c.
+// Records from different threads are interleaved a buffer at a time,
+// so a reader has to sort by timestamp to recover the global order.
+//
+// Timestamps are taken *before* an xfree and *after* an xmalloc or
+// xrealloc returns, so an address is always freed before it shows
+// up again in a later allocation.
+
+#define XTRACE_MALLOC  1
+#define XTRACE_FREE    2
+#define XTRACE_REALLOC 3
+
+typedef struct xtrace_rec {
+    uint64_t ts;    // nanoseconds since the trace started
+    uint64_t ptr;   // returned pointer, or the freed pointer
+    uint64_t old;   // previous pointer (realloc only)
+    uint32_t size;  // requested bytes (saturated at UINT32_MAX)
+    uint16_t tid;   // small per-thread id, in thread start order
+    uint8_t  op;    // XTRACE_*
+    uint8_t  pad;
+} xtrace_rec;
+
+#endif